@@ -30,79 +30,2947 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <map>
+#include <list>
+#include <future>
+#include <memory_resource>
+#include <mutex>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <new>
+#include <tuple>
+#include <array>
+#include <algorithm>
+#include <filesystem>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DFUSE_CRC_PCLMUL 1
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define DFUSE_CRC_ARM 1
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define DFUSE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DFUSE_HEX_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define DFUSE_HEX_NEON 1
+#endif
 
 namespace dfuse {
 
-class DFUTarget {
-public:
-    uint32_t Address() { return m_prefix.Address; }
-    int Size() { return m_prefix.Size; }
-    const std::vector<uint8_t>& Data() const { return m_elements; }
-private:
-    friend std::istream & operator >> (std::istream &in,  DFUTarget &obj) {
-        in >> obj.m_prefix;
+// Read-only view of element bytes, either owned by a DFUTarget or pointing
+// into a memory mapping held by the target.
+class ByteSpan {
+public:
+    ByteSpan() : m_data(nullptr), m_size(0) {}
+    ByteSpan(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+    ByteSpan(const std::vector<uint8_t>& vec) : m_data(vec.data()), m_size(vec.size()) {}
+
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const uint8_t* begin() const { return m_data; }
+    const uint8_t* end() const { return m_data + m_size; }
+    uint8_t operator[](size_t i) const { return m_data[i]; }
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+};
+
+// Mapped and memory loads verify the suffix CRC at open, which reads every
+// payload page once (on all cores for large files). Opening then costs the
+// payload bytes, not just the prefixes, in exchange for the integrity
+// check. Lazy is the mode whose open cost follows the prefixes only, its
+// CRC is left unchecked.
+enum class LoadMode {
+    Stream,     // Read every element into memory owned by its DFUTarget
+    Mapped,     // Map the file read-only, elements reference the mapping
+    Lazy,       // Only parse prefixes, elements are read on first Data() access
+    Indexed,    // Mapped, but reuse the <file>.dfuidx sidecar if the file is unchanged
+    Arena       // Copy all payloads into one cache line aligned block, see DFUFile
+};
+
+namespace detail {
+
+// Fixed set of worker threads shared by the parallel code paths
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = std::thread::hardware_concurrency();
+        }
+        threads = threads ? threads : 1;
+        for (unsigned i = 0; i < threads; i++) {
+            m_workers.emplace_back([this] {
+                std::function<void()> task;
+                while (Take(task, true)) {
+                    task();
+                }
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    unsigned Size() const { return (unsigned)m_workers.size(); }
+
+    void Submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_tasks.push_back(std::move(task));
+        }
+        m_wake.notify_one();
+    }
+
+    // Run one queued task on the calling thread, lets waiters help out
+    // instead of blocking a worker
+    bool RunOne() {
+        std::function<void()> task;
+        if (!Take(task, false)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+    // Call fn(i) for i in [0, count), the calling thread takes part. Helpers
+    // may start or finish after the last item is done, so the loop state is
+    // shared with them rather than living on this stack frame.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& fn) {
+        if (count == 0) {
+            return;
+        }
+        struct Loop {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> remaining;
+            size_t count;
+            const std::function<void(size_t)>* fn;
+        };
+        auto loop = std::make_shared<Loop>();
+        loop->remaining = count;
+        loop->count = count;
+        loop->fn = &fn;
+        // fn is only called for claimed items, all of which finish before
+        // this function returns
+        auto work = [loop] {
+            size_t i;
+            while ((i = loop->next++) < loop->count) {
+                (*loop->fn)(i);
+                loop->remaining--;
+            }
+        };
+        size_t helpers = count - 1 < Size() ? count - 1 : Size();
+        for (size_t i = 0; i < helpers; i++) {
+            Submit(work);
+        }
+        work();
+        while (loop->remaining > 0) {
+            if (!RunOne()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    static ThreadPool& Shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+private:
+    bool Take(std::function<void()>& task, bool wait) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (wait) {
+            m_wake.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+        }
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        return true;
+    }
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    bool m_stopping = false;
+};
+
+} // namespace detail
+
+// CRC-32 as used by the DFU suffix: reflected polynomial 0xEDB88320, the
+// register starts at 0xFFFFFFFF and is stored without the final inversion.
+namespace crc {
+
+namespace detail {
+
+struct Tables {
+    uint32_t Slice[8][256];
+
+    Tables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            }
+            Slice[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                Slice[k][i] = (Slice[k - 1][i] >> 8) ^ Slice[0][Slice[k - 1][i] & 0xFF];
+            }
+        }
+    }
+
+    static const Tables& Get() {
+        static const Tables tables;
+        return tables;
+    }
+};
+
+inline uint32_t UpdateSlicing8(uint32_t crc, const uint8_t* data, size_t size) {
+    const Tables& t = Tables::Get();
+    while (size >= 8) {
+        uint32_t one, two;
+        std::memcpy(&one, data, 4);
+        std::memcpy(&two, data + 4, 4);
+        one ^= crc;
+        crc = t.Slice[7][one & 0xFF] ^ t.Slice[6][(one >> 8) & 0xFF]
+            ^ t.Slice[5][(one >> 16) & 0xFF] ^ t.Slice[4][one >> 24]
+            ^ t.Slice[3][two & 0xFF] ^ t.Slice[2][(two >> 8) & 0xFF]
+            ^ t.Slice[1][(two >> 16) & 0xFF] ^ t.Slice[0][two >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ t.Slice[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(DFUSE_CRC_PCLMUL)
+// Carry-less multiply folding, see Intel "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction". Requires size >= 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+inline uint32_t FoldPclmul(uint32_t crc, const uint8_t* data, size_t size) {
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    data += 64;
+    size -= 64;
+
+    // Fold four 128 bit lanes in parallel
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+        data += 64;
+        size -= 64;
+    }
+
+    // Fold the lanes into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (size >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+inline uint32_t UpdatePclmul(uint32_t crc, const uint8_t* data, size_t size) {
+    if (size >= 64) {
+        size_t folded = size & ~(size_t)15;
+        crc = FoldPclmul(crc, data, folded);
+        data += folded;
+        size -= folded;
+    }
+    return UpdateSlicing8(crc, data, size);
+}
+#endif
+
+#if defined(DFUSE_CRC_ARM)
+#if defined(__clang__)
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+inline uint32_t UpdateArm(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size >= 8) {
+        uint64_t value;
+        std::memcpy(&value, data, 8);
+        crc = __crc32d(crc, value);
+        data += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = __crc32b(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+typedef uint32_t (*UpdateFunction)(uint32_t crc, const uint8_t* data, size_t size);
+
+// Pick the fastest kernel the CPU supports, once
+inline UpdateFunction SelectKernel() {
+#if defined(DFUSE_CRC_PCLMUL)
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        return UpdatePclmul;
+    }
+#elif defined(DFUSE_CRC_ARM)
+#if defined(__APPLE__)
+    return UpdateArm;
+#elif defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        return UpdateArm;
+    }
+#endif
+#endif
+    return UpdateSlicing8;
+}
+
+} // namespace detail
+
+// Feed bytes into a CRC register
+inline uint32_t Update(uint32_t crc, const void* data, size_t size) {
+    static const detail::UpdateFunction kernel = detail::SelectKernel();
+    return kernel(crc, (const uint8_t*)data, size);
+}
+
+// CRC of a whole block the way the DFU suffix stores it
+inline uint32_t Compute(const void* data, size_t size) {
+    return Update(0xFFFFFFFF, data, size);
+}
+
+namespace detail {
+
+// a * b modulo the CRC polynomial, reflected bit order
+inline uint32_t MultModP(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) modulo the CRC polynomial
+inline uint32_t X2NModP(uint64_t n, unsigned k) {
+    struct Powers {
+        uint32_t Table[32];
+        Powers() {
+            uint32_t p = (uint32_t)1 << 30; // x^1
+            Table[0] = p;
+            for (int i = 1; i < 32; i++) {
+                Table[i] = p = MultModP(p, p);
+            }
+        }
+    };
+    static const Powers powers;
+
+    uint32_t p = (uint32_t)1 << 31; // x^0
+    while (n) {
+        if (n & 1) {
+            p = MultModP(powers.Table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+} // namespace detail
+
+// Given crcA = Update(init, A) and crcB = Compute(B), returns Update(init, A + B)
+// without touching the bytes again.
+inline uint32_t Combine(uint32_t crcA, uint32_t crcB, uint64_t sizeB) {
+    return detail::MultModP(detail::X2NModP(sizeB, 3), crcA ^ 0xFFFFFFFF) ^ crcB;
+}
+
+// Same as Update, large blocks are split into chunks which are CRCed on the
+// shared thread pool and merged with Combine. threads = 0 uses every worker.
+inline uint32_t UpdateParallel(uint32_t crc, const void* data, size_t size, unsigned threads = 0) {
+    const size_t minChunk = 4 * 1024 * 1024;
+    ::dfuse::detail::ThreadPool& pool = ::dfuse::detail::ThreadPool::Shared();
+    size_t chunks = threads ? threads : pool.Size() + 1;
+    if (size / minChunk < chunks) {
+        chunks = size / minChunk;
+    }
+    if (chunks < 2) {
+        return Update(crc, data, size);
+    }
+
+    size_t chunkSize = (size / chunks + 63) & ~(size_t)63;
+    chunks = (size + chunkSize - 1) / chunkSize;
+    std::vector<uint32_t> results(chunks);
+    const uint8_t* bytes = (const uint8_t*)data;
+    pool.ParallelFor(chunks, [&](size_t i) {
+        size_t offset = i * chunkSize;
+        size_t length = size - offset < chunkSize ? size - offset : chunkSize;
+        results[i] = Compute(bytes + offset, length);
+    });
+
+    for (size_t i = 0; i < chunks; i++) {
+        size_t offset = i * chunkSize;
+        size_t length = size - offset < chunkSize ? size - offset : chunkSize;
+        crc = Combine(crc, results[i], length);
+    }
+    return crc;
+}
+
+} // namespace crc
+
+namespace detail {
+
+#if !defined(_WIN32)
+// Write a scatter list to a descriptor with as few writev calls as possible
+inline bool WriteAll(int fd, const std::vector<ByteSpan>& segments) {
+    const size_t batch = 512;
+    std::vector<struct iovec> iov;
+    iov.reserve(batch);
+    size_t next = 0;
+    while (next < segments.size() || !iov.empty()) {
+        while (iov.size() < batch && next < segments.size()) {
+            if (!segments[next].empty()) {
+                iov.push_back({(void*)segments[next].data(), segments[next].size()});
+            }
+            next++;
+        }
+        if (iov.empty()) {
+            break;
+        }
+        ssize_t written = ::writev(fd, iov.data(), (int)iov.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // Drop what was written, a partial write leaves the rest of a segment
+        size_t done = 0;
+        while (done < iov.size() && (size_t)written >= iov[done].iov_len) {
+            written -= iov[done].iov_len;
+            done++;
+        }
+        if (done < iov.size()) {
+            iov[done].iov_base = (char*)iov[done].iov_base + written;
+            iov[done].iov_len -= written;
+        }
+        iov.erase(iov.begin(), iov.begin() + done);
+    }
+    return true;
+}
+#endif
+
+#if !defined(_WIN32)
+// Copy size bytes at offset of in to the current position of out. On Linux
+// the bytes stay in the kernel: copy_file_range, then sendfile, and only
+// then a read/write loop.
+inline bool CopyFileRange(int in, uint64_t offset, uint64_t size, int out) {
+#if defined(__linux__)
+    off_t inOffset = offset;
+    while (size > 0) {
+        ssize_t copied = ::copy_file_range(in, &inOffset, out, nullptr, size, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+        size -= copied;
+    }
+    while (size > 0) {
+        ssize_t copied = ::sendfile(out, in, &inOffset, size);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+        size -= copied;
+    }
+    offset = inOffset;
+#endif
+    std::vector<char> buffer(size ? 1024 * 1024 : 0);
+    while (size > 0) {
+        size_t chunk = size < buffer.size() ? (size_t)size : buffer.size();
+        ssize_t count = ::pread(in, buffer.data(), chunk, offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        ByteSpan span((const uint8_t*)buffer.data(), count);
+        if (!WriteAll(out, std::vector<ByteSpan>(1, span))) {
+            return false;
+        }
+        offset += count;
+        size -= count;
+    }
+    return true;
+}
+#endif
+
+#if defined(DFUSE_IO_URING)
+// Minimal io_uring over the raw syscalls. Requests are queued with Next(),
+// sent to the kernel in one Submit() and collected with Reap(). Not thread
+// safe, IsOpen() is false when the kernel or a sandbox refuses io_uring.
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0) {
+            return;
+        }
+        m_sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            m_sqSize = m_cqSize = m_sqSize > m_cqSize ? m_sqSize : m_cqSize;
+        }
+        m_sqRing = ::mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        m_cqRing = single ? m_sqRing
+            : ::mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = ::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) {
+                ::munmap(sqes, m_sqesSize);
+            }
+            Release();
+            return;
+        }
+        m_sqes = (io_uring_sqe*)sqes;
+        char* sq = (char*)m_sqRing;
+        char* cq = (char*)m_cqRing;
+        m_sqHead = (unsigned*)(sq + params.sq_off.head);
+        m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+        m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        m_sqArray = (unsigned*)(sq + params.sq_off.array);
+        m_cqHead = (unsigned*)(cq + params.cq_off.head);
+        m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+        m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        m_entries = params.sq_entries;
+        m_tail = *m_sqTail;
+    }
+
+    ~IoUring() {
+        if (m_sqes) {
+            ::munmap(m_sqes, m_sqesSize);
+        }
+        Release();
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool IsOpen() const { return m_sqes != nullptr; }
+    unsigned Entries() const { return m_entries; }
+
+    // Pin buffers for READ_FIXED, index i of the iovec array is buf_index i
+    bool RegisterBuffers(const struct iovec* buffers, unsigned count) {
+        return ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+
+    // A zeroed submission entry, or nullptr when the queue is full
+    io_uring_sqe* Next(uint64_t userData) {
+        if (m_tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_entries) {
+            return nullptr;
+        }
+        unsigned index = m_tail & m_sqMask;
+        io_uring_sqe* sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = userData;
+        m_sqArray[index] = index;
+        m_tail++;
+        return sqe;
+    }
+
+    // Submit everything queued and wait for at least wait completions
+    bool Submit(unsigned wait) {
+        __atomic_store_n(m_sqTail, m_tail, __ATOMIC_RELEASE);
+        unsigned pending = m_tail - m_submitted;
+        while (pending > 0 || wait > 0) {
+            long done = ::syscall(__NR_io_uring_enter, m_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (done < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            m_submitted += (unsigned)done;
+            pending -= (unsigned)done;
+            if (pending == 0) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Call fn(userData, result) for every completion, returns how many
+    template <typename Fn>
+    unsigned Reap(Fn fn) {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = tail - head;
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+            fn(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Submit and collect exactly count completions
+    template <typename Fn>
+    bool Run(unsigned count, Fn fn) {
+        while (count > 0) {
+            if (!Submit(count)) {
+                return false;
+            }
+            count -= Reap(fn);
+        }
+        return true;
+    }
+
+private:
+    void Release() {
+        if (m_cqRing && m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+            ::munmap(m_cqRing, m_cqSize);
+        }
+        if (m_sqRing && m_sqRing != MAP_FAILED) {
+            ::munmap(m_sqRing, m_sqSize);
+        }
+        m_sqRing = m_cqRing = nullptr;
+        m_sqes = nullptr;
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    int m_fd = -1;
+    void* m_sqRing = nullptr;
+    void* m_cqRing = nullptr;
+    size_t m_sqSize = 0;
+    size_t m_cqSize = 0;
+    size_t m_sqesSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_entries = 0;
+    unsigned m_tail = 0;
+    unsigned m_submitted = 0;
+};
+
+// One file read through BatchRead
+struct BatchFile {
+    int Error = 0;
+    uint64_t Size = 0;
+    uint8_t Head[16];
+    uint8_t Tail[16];
+    std::vector<uint8_t> Data;
+    bool Deferred = false;  // not read whole, it did not fit the byte budget
+};
+
+// Opens, stats, reads and closes a batch of files with a handful of ring
+// round trips instead of several syscalls per file. Head and Tail get the
+// first and last 16 bytes through registered buffers, Data the whole file
+// when whole is set. Whole reads stop at maxBytes per batch, files that do
+// not fit are marked Deferred. Operations the kernel does not know fall
+// back to the plain syscall.
+class BatchReader {
+public:
+    static const unsigned MaxFiles = 256;
+
+    BatchReader() : m_ring(2 * MaxFiles), m_buffers(MaxFiles * 32) {
+        if (m_ring.IsOpen()) {
+            struct iovec buffer = { m_buffers.data(), m_buffers.size() };
+            m_registered = m_ring.RegisterBuffers(&buffer, 1);
+        }
+    }
+
+    bool IsOpen() const { return m_ring.IsOpen(); }
+
+    // Read paths[first, first + count), count <= MaxFiles
+    bool Read(const std::vector<std::string>& paths, size_t first, size_t count, bool whole, std::vector<BatchFile>& files,
+              uint64_t maxBytes = UINT64_MAX) {
+        files.assign(count, BatchFile());
+        std::vector<int> fds(count, -1);
+        std::vector<struct statx> stats(count);
+
+        unsigned queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            io_uring_sqe* sqe = m_ring.Next(i);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)paths[first + i].c_str();
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            queued++;
+        }
+        bool ok = m_ring.Run(queued, [&](uint64_t i, int result) {
+            if (Unsupported(result)) {
+                result = ::open(paths[first + i].c_str(), O_RDONLY | O_CLOEXEC);
+                result = result < 0 ? -errno : result;
+            }
+            fds[i] = result < 0 ? -1 : result;
+            files[i].Error = result < 0 ? -result : 0;
+        });
+
+        // Size and the first bytes together
+        queued = 0;
+        for (size_t i = 0; ok && i < count; i++) {
+            if (fds[i] < 0) {
+                continue;
+            }
+            io_uring_sqe* sqe = m_ring.Next(i * 2);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = fds[i];
+            sqe->addr = (uint64_t)(uintptr_t)"";
+            sqe->len = STATX_SIZE;
+            sqe->off = (uint64_t)(uintptr_t)&stats[i];
+            sqe->statx_flags = AT_EMPTY_PATH;
+            queued++;
+            if (!whole) {
+                QueueRead(i * 2 + 1, fds[i], Slot(i), 16, 0);
+                queued++;
+            }
+        }
+        ok = ok && m_ring.Run(queued, [&](uint64_t tag, int result) {
+            size_t i = tag / 2;
+            if (tag % 2 == 0) {
+                if (Unsupported(result)) {
+                    struct stat st;
+                    if (::fstat(fds[i], &st) == 0) {
+                        stats[i].stx_size = st.st_size;
+                        result = 0;
+                    } else {
+                        result = -errno;
+                    }
+                }
+                files[i].Size = result < 0 ? 0 : stats[i].stx_size;
+            } else {
+                if (Unsupported(result)) {
+                    result = (int)::pread(fds[i], Slot(i), 16, 0);
+                    result = result < 0 ? -errno : result;
+                }
+                std::memcpy(files[i].Head, Slot(i), result > 0 ? result : 0);
+            }
+            if (result < 0 && files[i].Error == 0) {
+                files[i].Error = -result;
+            }
+        });
+
+        uint64_t budget = maxBytes;
+        for (size_t i = 0; whole && i < count; i++) {
+            if (fds[i] >= 0 && files[i].Error == 0) {
+                files[i].Deferred = files[i].Size > budget;
+                budget -= files[i].Deferred ? 0 : files[i].Size;
+            }
+        }
+
+        // The last bytes, or the whole file
+        std::vector<uint64_t> done(count, 0);
+        bool more = true;
+        while (ok && more) {
+            more = false;
+            queued = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (fds[i] < 0 || files[i].Error || files[i].Deferred) {
+                    continue;
+                }
+                if (!whole && done[i] == 0) {
+                    if (files[i].Size >= 16) {
+                        QueueRead(i, fds[i], Slot(i) + 16, 16, files[i].Size - 16);
+                        queued++;
+                    }
+                } else if (whole && done[i] < files[i].Size) {
+                    files[i].Data.resize(files[i].Size);
+                    uint64_t left = files[i].Size - done[i];
+                    io_uring_sqe* sqe = m_ring.Next(i);
+                    sqe->opcode = IORING_OP_READ;
+                    sqe->fd = fds[i];
+                    sqe->addr = (uint64_t)(uintptr_t)(files[i].Data.data() + done[i]);
+                    sqe->len = (unsigned)(left < 0x40000000 ? left : 0x40000000);
+                    sqe->off = done[i];
+                    queued++;
+                }
+            }
+            ok = m_ring.Run(queued, [&](uint64_t i, int result) {
+                if (Unsupported(result)) {
+                    void* to = whole ? (void*)(files[i].Data.data() + done[i]) : (void*)(Slot(i) + 16);
+                    size_t size = whole ? files[i].Size - done[i] : 16;
+                    result = (int)::pread(fds[i], to, size, whole ? done[i] : files[i].Size - 16);
+                    result = result < 0 ? -errno : result;
+                }
+                if (result <= 0) {
+                    files[i].Error = result < 0 ? -result : EIO;
+                } else if (whole) {
+                    done[i] += result;
+                    more = more || done[i] < files[i].Size;
+                } else {
+                    done[i] = result;
+                    std::memcpy(files[i].Tail, Slot(i) + 16, 16);
+                    files[i].Error = result == 16 ? 0 : EIO;
+                }
+            });
+        }
+
+        queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (fds[i] >= 0) {
+                io_uring_sqe* sqe = ok ? m_ring.Next(i) : nullptr;
+                if (!sqe) {
+                    ::close(fds[i]);
+                    continue;
+                }
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[i];
+                queued++;
+            }
+        }
+        return m_ring.Run(queued, [&](uint64_t i, int result) {
+            if (Unsupported(result)) {
+                ::close(fds[i]);
+            }
+        }) && ok;
+    }
+
+private:
+    static bool Unsupported(int result) { return result == -EINVAL || result == -EOPNOTSUPP; }
+
+    uint8_t* Slot(size_t i) { return m_buffers.data() + i * 32; }
+
+    void QueueRead(uint64_t tag, int fd, uint8_t* to, unsigned size, uint64_t offset) {
+        io_uring_sqe* sqe = m_ring.Next(tag);
+        sqe->opcode = m_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)to;
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->buf_index = 0;
+    }
+
+    IoUring m_ring;
+    std::vector<uint8_t> m_buffers;
+    bool m_registered = false;
+};
+#endif
+
+// Backing store for element payloads which are not copied into the DFUTarget
+class Storage {
+public:
+    virtual ~Storage() {}
+    virtual uint64_t Size() const =0;
+    // Empty if the payload can no longer be read
+    virtual ByteSpan Slice(uint64_t offset, uint32_t size) const =0;
+    // Whole backing store if it is resident in memory, otherwise nullptr
+    virtual const uint8_t* Contiguous() const { return nullptr; }
+#if !defined(_WIN32)
+    // Copy a payload file to file without passing through user space, false
+    // if the storage is not a file
+    virtual bool CopyTo(int /*out*/, uint64_t /*offset*/, uint32_t /*size*/) const { return false; }
+#endif
+};
+
+#if !defined(_WIN32)
+// Identifies one version of a file: same inode, size and modification time
+struct FileKey {
+    uint64_t Device = 0;
+    uint64_t Inode = 0;
+    uint64_t Size = 0;
+    int64_t Modified = 0;   // nanoseconds
+
+    static FileKey Of(const struct stat& st) {
+        FileKey key;
+        key.Device = st.st_dev;
+        key.Inode = st.st_ino;
+        key.Size = st.st_size;
+#if defined(__APPLE__)
+        key.Modified = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        key.Modified = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        return key;
+    }
+
+    bool operator==(const FileKey& other) const {
+        return Device == other.Device && Inode == other.Inode && Size == other.Size && Modified == other.Modified;
+    }
+    bool operator!=(const FileKey& other) const { return !(*this == other); }
+};
+#endif
+
+class MappedFile : public Storage {
+public:
+    static std::shared_ptr<MappedFile> Open(const char* filename) {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+        file->m_filename = filename;
+#if defined(_WIN32)
+        HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+            CloseHandle(handle);
+            return nullptr;
+        }
+        file->m_mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(handle);
+        if (file->m_mapping == NULL) {
+            return nullptr;
+        }
+        file->m_data = (const uint8_t*)MapViewOfFile(file->m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (file->m_data == nullptr) {
+            return nullptr;
+        }
+        file->m_size = size.QuadPart;
+#else
+        int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void* addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        file->m_data = (const uint8_t*)addr;
+        file->m_size = st.st_size;
+        file->m_key = FileKey::Of(st);
+#endif
+        return file;
+    }
+
+    ~MappedFile() {
+#if defined(_WIN32)
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+#else
+        if (m_data) ::munmap((void*)m_data, m_size);
+#endif
+    }
+
+    const uint8_t* Data() const { return m_data; }
+    virtual uint64_t Size() const override { return m_size; }
+    virtual const uint8_t* Contiguous() const override { return m_data; }
+    virtual ByteSpan Slice(uint64_t offset, uint32_t size) const override {
+        return ByteSpan(m_data + offset, size);
+    }
+#if !defined(_WIN32)
+    virtual bool CopyTo(int out, uint64_t offset, uint32_t size) const override {
+        // Only if the path still names the file that was mapped
+        int fd = ::open(m_filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0 && st.st_dev == (dev_t)m_key.Device && st.st_ino == (ino_t)m_key.Inode
+            && (uint64_t)st.st_size == m_size && CopyFileRange(fd, offset, size, out);
+        ::close(fd);
+        return ok;
+    }
+
+    const FileKey& Key() const { return m_key; }
+#endif
+
+private:
+    MappedFile() : m_data(nullptr), m_size(0) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+#if defined(_WIN32)
+    HANDLE m_mapping = NULL;
+#else
+    FileKey m_key;
+#endif
+    std::string m_filename;
+    const uint8_t* m_data;
+    uint64_t m_size;
+};
+
+// Payload read into memory, shared by every copy of the element
+class Buffer : public Storage {
+public:
+    explicit Buffer(std::vector<uint8_t> data) : m_data(std::move(data)) {}
+    virtual uint64_t Size() const override { return m_data.size(); }
+    virtual const uint8_t* Contiguous() const override { return m_data.data(); }
+    virtual ByteSpan Slice(uint64_t offset, uint32_t size) const override {
+        return ByteSpan(m_data.data() + offset, size);
+    }
+private:
+    std::vector<uint8_t> m_data;
+};
+
+// One block from a memory resource holding every payload of a file
+class Arena : public Storage {
+public:
+    static constexpr size_t Alignment = 64;
+
+    Arena(std::pmr::memory_resource* resource, size_t size)
+        : m_resource(resource), m_size(size),
+          m_data((uint8_t*)resource->allocate(size ? size : 1, Alignment)) {}
+    ~Arena() { m_resource->deallocate(m_data, m_size ? m_size : 1, Alignment); }
+
+    uint8_t* Data() { return m_data; }
+    virtual uint64_t Size() const override { return m_size; }
+    virtual const uint8_t* Contiguous() const override { return m_data; }
+    virtual ByteSpan Slice(uint64_t offset, uint32_t size) const override {
+        return ByteSpan(m_data + offset, size);
+    }
+
+private:
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    std::pmr::memory_resource* m_resource;
+    size_t m_size;
+    uint8_t* m_data;
+};
+
+// Caller owned memory, the caller keeps it alive for as long as the
+// DFUFile parsed from it
+class MemoryView : public Storage {
+public:
+    MemoryView(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+    virtual uint64_t Size() const override { return m_size; }
+    virtual const uint8_t* Contiguous() const override { return m_data; }
+    virtual ByteSpan Slice(uint64_t offset, uint32_t size) const override {
+        return ByteSpan(m_data + offset, size);
+    }
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+};
+
+// Reads element payloads from the file the first time they are requested
+class LazyFile : public Storage {
+public:
+    LazyFile(const char* filename, uint64_t size) : m_filename(filename), m_size(size) {}
+#if !defined(_WIN32)
+    // key identifies the file that was parsed, payloads are only read back
+    // from a file that still matches it
+    LazyFile(const char* filename, uint64_t size, const FileKey& key)
+        : m_filename(filename), m_size(size), m_key(key), m_hasKey(true) {}
+    ~LazyFile() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+#endif
+
+    virtual uint64_t Size() const override { return m_size; }
+    virtual ByteSpan Slice(uint64_t offset, uint32_t size) const override {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto it = m_payloads.find(offset);
+        if (it != m_payloads.end()) {
+            return ByteSpan(it->second);
+        }
+
+        std::vector<uint8_t> payload(size);
+#if defined(_WIN32)
+        if (!m_file.is_open()) {
+            m_file.open(m_filename, std::ios_base::binary);
+        }
+        m_file.clear();
+        m_file.seekg(offset);
+        m_file.read((char*)payload.data(), size);
+        if (!m_file) {
+            return ByteSpan();
+        }
+#else
+        int fd = Descriptor();
+        size_t done = 0;
+        while (fd >= 0 && done < size) {
+            ssize_t count = ::pread(fd, payload.data() + done, size - done, offset + done);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            done += count;
+        }
+        if (done < size) {
+            return ByteSpan();
+        }
+#endif
+        return ByteSpan(m_payloads.emplace(offset, std::move(payload)).first->second);
+    }
+#if !defined(_WIN32)
+    virtual bool CopyTo(int out, uint64_t offset, uint32_t size) const override {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            fd = Descriptor();
+        }
+        return fd >= 0 && CopyFileRange(fd, offset, size, out);
+    }
+#endif
+
+private:
+#if !defined(_WIN32)
+    // Opened on first use and kept, -1 if the path no longer names the file
+    // that was parsed. Called with m_lock held.
+    int Descriptor() const {
+        if (m_fd < 0 && !m_failed) {
+            int fd = ::open(m_filename.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd >= 0 && ::fstat(fd, &st) == 0 && (uint64_t)st.st_size == m_size
+                && (!m_hasKey || FileKey::Of(st) == m_key)) {
+                m_fd = fd;
+            } else {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                m_failed = true;
+            }
+        }
+        return m_fd;
+    }
+#endif
+
+    std::string m_filename;
+    uint64_t m_size;
+    mutable std::mutex m_lock;
+#if defined(_WIN32)
+    mutable std::ifstream m_file;
+#else
+    FileKey m_key;
+    bool m_hasKey = false;
+    mutable int m_fd = -1;
+    mutable bool m_failed = false;
+#endif
+    mutable std::map<uint64_t, std::vector<uint8_t>> m_payloads;
+};
+
+// Stream buffers which can hand out element payloads by reference implement
+// this, DFUTarget records its offset in the storage instead of reading it.
+class StorageSource {
+public:
+    virtual ~StorageSource() {}
+    virtual std::shared_ptr<const Storage> GetStorage() const =0;
+};
+
+// Seekable std::streambuf over a block of memory, nothing is copied
+class MemoryBuf : public std::streambuf {
+public:
+    MemoryBuf(const uint8_t* data, size_t size) {
+        char* begin = (char*)data;
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        off_type base = 0;
+        if (dir == std::ios_base::cur) {
+            base = gptr() - eback();
+        } else if (dir == std::ios_base::end) {
+            base = egptr() - eback();
+        }
+        return seekpos(base + off, which);
+    }
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in) || pos < 0 || pos > egptr() - eback()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), eback() + (off_type)pos, egptr());
+        return pos;
+    }
+};
+
+// Zero-copy std::streambuf over a mapped file so the regular decoders can be
+// used to walk the prefixes.
+class ViewBuf : public MemoryBuf, public StorageSource {
+public:
+    ViewBuf(std::shared_ptr<const MappedFile> file)
+        : MemoryBuf(file->Data(), file->Size()), m_file(file) {}
+    virtual std::shared_ptr<const Storage> GetStorage() const override { return m_file; }
+
+private:
+    std::shared_ptr<const MappedFile> m_file;
+};
+
+// File buffer which records element locations, DFUTarget seeks over payloads
+class LazyFileBuf : public std::filebuf, public StorageSource {
+public:
+    LazyFileBuf(const char* filename) {
+        if (open(filename, std::ios_base::in | std::ios_base::binary)) {
+            std::streamoff size = pubseekoff(0, std::ios_base::end, std::ios_base::in);
+            pubseekpos(0, std::ios_base::in);
+            if (size > 0) {
+#if defined(_WIN32)
+                m_file = std::make_shared<LazyFile>(filename, size);
+#else
+                // Identify the file now so a later replacement is not read
+                struct stat st;
+                if (::stat(filename, &st) == 0 && st.st_size == size) {
+                    m_file = std::make_shared<LazyFile>(filename, size, FileKey::Of(st));
+                }
+#endif
+            }
+        }
+    }
+    bool IsOpen() const { return m_file != nullptr; }
+    virtual std::shared_ptr<const Storage> GetStorage() const override { return m_file; }
+
+private:
+    std::shared_ptr<const LazyFile> m_file;
+};
+
+// Wraps a sequential source and computes the CRC of the bytes as the
+// decoders consume them, so verifying the file takes no extra pass.
+class CrcBuf : public std::streambuf {
+public:
+    CrcBuf(std::streambuf& source, size_t bufferSize = 64 * 1024)
+        : m_source(source), m_buffer(bufferSize), m_crc(0xFFFFFFFF) {
+        setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+        m_mark = m_buffer.data();
+    }
+
+    // CRC of everything consumed so far
+    uint32_t Checkpoint() {
+        Fold(gptr());
+        return m_crc;
+    }
+
+protected:
+    virtual int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        Fold(egptr());
+        std::streamsize count = m_source.sgetn(m_buffer.data(), m_buffer.size());
+        m_mark = m_buffer.data();
+        if (count <= 0) {
+            setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+            return traits_type::eof();
+        }
+        setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + count);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    virtual std::streamsize xsgetn(char* s, std::streamsize n) override {
+        std::streamsize done = 0;
+        while (done < n) {
+            std::streamsize available = egptr() - gptr();
+            if (available > 0) {
+                std::streamsize count = available < n - done ? available : n - done;
+                std::memcpy(s + done, gptr(), count);
+                gbump((int)count);
+                done += count;
+                continue;
+            }
+
+            // Large reads skip the buffer and are folded in the caller's memory
+            if (n - done >= (std::streamsize)m_buffer.size()) {
+                Fold(gptr());
+                std::streamsize count = m_source.sgetn(s + done, n - done);
+                if (count <= 0) {
+                    break;
+                }
+                m_crc = crc::Update(m_crc, s + done, count);
+                done += count;
+                continue;
+            }
+
+            if (traits_type::eq_int_type(underflow(), traits_type::eof())) {
+                break;
+            }
+        }
+        return done;
+    }
+
+private:
+    void Fold(const char* end) {
+        m_crc = crc::Update(m_crc, m_mark, end - m_mark);
+        m_mark = end;
+    }
+
+    std::streambuf& m_source;
+    std::vector<char> m_buffer;
+    const char* m_mark;
+    uint32_t m_crc;
+};
+
+} // namespace detail
+
+// Byte sources a DFUFile can be parsed from. Each is a std::streambuf so the
+// same decoders are used regardless of where the bytes come from.
+namespace source {
+
+// Zero-copy source over caller owned memory, elements reference the buffer
+class Memory : public detail::MemoryBuf, public detail::StorageSource {
+public:
+    Memory(const void* data, size_t size)
+        : MemoryBuf((const uint8_t*)data, size),
+          m_view(std::make_shared<detail::MemoryView>((const uint8_t*)data, size)) {}
+    virtual std::shared_ptr<const detail::Storage> GetStorage() const override { return m_view; }
+private:
+    std::shared_ptr<const detail::MemoryView> m_view;
+};
+
+// Sequential source pulling bytes from a function. The function fills up to
+// size bytes and returns how many it wrote, 0 at the end of the data.
+class Callback : public std::streambuf {
+public:
+    typedef std::function<size_t(void* buffer, size_t size)> ReadFunction;
+
+    Callback(ReadFunction read, size_t bufferSize = 64 * 1024)
+        : m_read(read), m_buffer(bufferSize) {
+        setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+    }
+
+protected:
+    virtual int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        size_t count = m_read(m_buffer.data(), m_buffer.size());
+        if (count == 0) {
+            return traits_type::eof();
+        }
+        setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + count);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    ReadFunction m_read;
+    std::vector<char> m_buffer;
+};
+
+#if !defined(_WIN32)
+// Reads from a file descriptor, works for pipes and sockets as well as files.
+// The descriptor is not closed.
+class Fd : public Callback {
+public:
+    Fd(int fd, size_t bufferSize = 64 * 1024) : Callback([fd](void* buffer, size_t size) -> size_t {
+        ssize_t count;
+        do {
+            count = ::read(fd, buffer, size);
+        } while (count < 0 && errno == EINTR);
+        return count > 0 ? count : 0;
+    }, bufferSize) {}
+};
+#endif
+
+} // namespace source
+
+class DFUTarget;
+
+namespace reader {
+bool ReadElf(const char* filename, std::vector<DFUTarget>& elements);
+}
+
+class DFUTarget {
+public:
+    DFUTarget() = default;
+    DFUTarget(uint32_t address, std::vector<uint8_t> data) {
+        m_prefix.Address = address;
+        m_prefix.Size = (uint32_t)data.size();
+        m_storage = std::make_shared<detail::Buffer>(std::move(data));
+    }
+    // Copies share the payload
+    DFUTarget(const DFUTarget&) = default;
+    DFUTarget(DFUTarget&&) noexcept = default;
+    DFUTarget& operator=(const DFUTarget&) = default;
+    DFUTarget& operator=(DFUTarget&&) noexcept = default;
+
+    uint32_t Address() const { return m_prefix.Address; }
+    int Size() const { return m_prefix.Size; }
+    bool IsReadable() const { return Data().size() == m_prefix.Size; }
+
+    // Write the payload to a raw file. Elements of mapped and lazy loads are
+    // copied file to file inside the kernel.
+    bool Extract(const std::string filename) const {
+#if defined(_WIN32)
+        if (!IsReadable()) {
+            return false;
+        }
+        std::ofstream out(filename, std::ofstream::binary);
+        out.write((const char*)Data().data(), Data().size());
+        out.close();
+        return (bool)out;
+#else
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = m_storage && m_storage->CopyTo(fd, m_offset, m_prefix.Size);
+        if (!ok) {
+            // Partial in-kernel copies start over from a user space buffer
+            ok = IsReadable() && ::ftruncate(fd, 0) == 0 && ::lseek(fd, 0, SEEK_SET) == 0
+                && detail::WriteAll(fd, std::vector<ByteSpan>(1, Data()));
+        }
+        if (::close(fd) != 0) {
+            ok = false;
+        }
+        return ok;
+#endif
+    }
+    // Shorter than Size() only if the payload of a lazy load can no longer
+    // be read, see IsReadable()
+    ByteSpan Data() const {
+        if (m_storage) {
+            return m_storage->Slice(m_offset, m_prefix.Size);
+        }
+        return ByteSpan();
+    }
+private:
+    DFUTarget(uint32_t address, std::shared_ptr<const detail::Storage> storage, uint64_t offset, uint32_t size)
+        : m_storage(storage), m_offset(offset) {
+        m_prefix.Address = address;
+        m_prefix.Size = size;
+    }
+
+    friend std::istream & operator >> (std::istream &in,  DFUTarget &obj) {
+        in >> obj.m_prefix;
+        if (!in) {
+            return in;
+        }
+
+        // Payload is mapped or loaded later, save the stream location
+        if (auto source = dynamic_cast<detail::StorageSource*>(in.rdbuf())) {
+            std::streamoff offset = in.tellg();
+            obj.m_storage = source->GetStorage();
+            if (offset < 0 || obj.m_prefix.Size > obj.m_storage->Size() - offset) {
+                obj.m_storage.reset();
+                in.setstate(std::ios_base::failbit);
+                return in;
+            }
+            obj.m_offset = offset;
+            in.seekg(obj.m_prefix.Size, std::ios_base::cur);
+            return in;
+        }
+
+        std::vector<uint8_t> data(obj.m_prefix.Size);
+        in.read((char*)data.data(), obj.m_prefix.Size);
+        obj.m_storage = std::make_shared<detail::Buffer>(std::move(data));
+        obj.m_offset = 0;
+
+        return in;
+    }
+    struct Prefix {
+        static constexpr size_t Length = 8;
+
+        uint32_t Address;
+        uint32_t Size;
+
+        void Encode(uint8_t* out) const {
+            std::memcpy(out, &Address, 4);
+            std::memcpy(out + 4, &Size, 4);
+        }
+
+        friend std::istream & operator >> (std::istream &in,  Prefix &obj) {
+            //   <   little endian
+            //   I   uint32_t    element address
+            //   I   uint32_t    element size
+            in.read((char*)&obj.Address, 4);
+            in.read((char*)&obj.Size, 4);
+            return in;
+        }
+    };
+    friend class StreamParser;
+    friend class DFUFile;
+    friend class DFUBuilder;
+    friend bool reader::ReadElf(const char* filename, std::vector<DFUTarget>& elements);
+
+    Prefix m_prefix;
+    std::shared_ptr<const detail::Storage> m_storage;
+    uint64_t m_offset = 0;
+};
+
+namespace detail {
+
+// Upper case hex text, 2 * size characters
+inline void EncodeHex(const uint8_t* in, size_t size, char* out) {
+#if defined(DFUSE_HEX_SSE2)
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('A' - '0' - 10);
+    while (size >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)in);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i lo = _mm_and_si128(v, mask);
+        hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letters));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letters));
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+        in += 16;
+        out += 32;
+        size -= 16;
+    }
+#elif defined(DFUSE_HEX_NEON)
+    const uint8x16_t digits = vld1q_u8((const uint8_t*)"0123456789ABCDEF");
+    while (size >= 16) {
+        uint8x16_t v = vld1q_u8(in);
+        uint8x16x2_t pair;
+        pair.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+        pair.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0F)));
+        vst2q_u8((uint8_t*)out, pair);
+        in += 16;
+        out += 32;
+        size -= 16;
+    }
+#endif
+    static const char digits[] = "0123456789ABCDEF";
+    while (size--) {
+        *out++ = digits[*in >> 4];
+        *out++ = digits[*in++ & 0x0F];
+    }
+}
+
+inline int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+#if defined(DFUSE_HEX_SSE2)
+// Nibble values of 16 hex characters, false if any is not a hex digit
+inline bool HexNibbles(__m128i c, __m128i& n) {
+    __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                    _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                     _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    n = _mm_or_si128(_mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                     _mm_and_si128(isLetter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+    return _mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)) == 0xFFFF;
+}
+#elif defined(DFUSE_HEX_NEON)
+inline bool HexNibbles(uint8x16_t c, uint8x16_t& n) {
+    uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t isDigit = vcleq_u8(digit, vdupq_n_u8(9));
+    uint8x16_t letter = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t isLetter = vcleq_u8(letter, vdupq_n_u8(5));
+    n = vorrq_u8(vandq_u8(isDigit, digit), vandq_u8(isLetter, vaddq_u8(letter, vdupq_n_u8(10))));
+    return vminvq_u8(vorrq_u8(isDigit, isLetter)) == 0xFF;
+}
+#endif
+
+// Decode size bytes from 2 * size hex characters of either case
+inline bool DecodeHex(const char* in, size_t size, uint8_t* out) {
+#if defined(DFUSE_HEX_SSE2)
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    while (size >= 16) {
+        __m128i a, b;
+        if (!HexNibbles(_mm_loadu_si128((const __m128i*)in), a)
+            || !HexNibbles(_mm_loadu_si128((const __m128i*)(in + 16)), b)) {
+            return false;
+        }
+        // Each 16 bit lane holds the high nibble then the low nibble
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low), 4), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, low), 4), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(a, b));
+        in += 32;
+        out += 16;
+        size -= 16;
+    }
+#elif defined(DFUSE_HEX_NEON)
+    while (size >= 16) {
+        uint8x16x2_t pair = vld2q_u8((const uint8_t*)in);
+        uint8x16_t hi, lo;
+        if (!HexNibbles(pair.val[0], hi) || !HexNibbles(pair.val[1], lo)) {
+            return false;
+        }
+        vst1q_u8(out, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+        in += 32;
+        out += 16;
+        size -= 16;
+    }
+#endif
+    while (size--) {
+        int hi = HexValue(*in++);
+        int lo = HexValue(*in++);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        *out++ = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+// Sum of the bytes modulo 256, record checksums are built from it
+inline uint8_t ByteSum(const uint8_t* data, size_t size) {
+    uint32_t sum = 0;
+#if defined(DFUSE_HEX_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    while (size >= 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)data), _mm_setzero_si128()));
+        data += 16;
+        size -= 16;
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(DFUSE_HEX_NEON)
+    while (size >= 16) {
+        sum += vaddlvq_u8(vld1q_u8(data));
+        data += 16;
+        size -= 16;
+    }
+#endif
+    while (size--) {
+        sum += *data++;
+    }
+    return (uint8_t)sum;
+}
+
+// Intel HEX records, lines never cross a 64K boundary so every record is
+// addressed through the current extended linear address
+class IntelHex {
+public:
+    static void Encode(uint32_t address, ByteSpan data, size_t recordSize, std::vector<char>& out) {
+        // Plan the exact output size before writing anything
+        size_t length = EofLength;
+        ForEachRecord(address, data.size(), recordSize, [&](uint32_t, size_t, size_t count, bool newBase) {
+            length += (newBase ? BaseLength : 0) + 12 + 2 * count;
+        });
+
+        size_t start = out.size();
+        out.resize(start + length);
+        char* position = out.data() + start;
+        ForEachRecord(address, data.size(), recordSize, [&](uint32_t lineAddress, size_t offset, size_t count, bool newBase) {
+            if (newBase) {
+                uint8_t base[2] = { (uint8_t)(lineAddress >> 24), (uint8_t)(lineAddress >> 16) };
+                position = Record(position, 0x04, 0, base, 2);
+            }
+            position = Record(position, 0x00, (uint16_t)lineAddress, data.data() + offset, count);
+        });
+        Record(position, 0x01, 0, nullptr, 0);
+    }
+
+    static char* Record(char* out, uint8_t type, uint16_t address, const uint8_t* data, size_t count) {
+        uint8_t header[4] = { (uint8_t)count, (uint8_t)(address >> 8), (uint8_t)address, type };
+        *out++ = ':';
+        EncodeHex(header, 4, out);
+        out += 8;
+        EncodeHex(data, count, out);
+        out += 2 * count;
+        uint8_t checksum = (uint8_t)(0x100 - ByteSum(header, 4) - ByteSum(data, count));
+        EncodeHex(&checksum, 1, out);
+        out += 2;
+        *out++ = '\n';
+        return out;
+    }
+
+    static const size_t BaseLength = 16;
+    static const size_t EofLength = 12;
+
+private:
+    template <typename Fn>
+    static void ForEachRecord(uint32_t address, size_t size, size_t recordSize, Fn fn) {
+        size_t offset = 0;
+        bool first = true;
+        while (offset < size) {
+            uint32_t lineAddress = address + (uint32_t)offset;
+            size_t count = recordSize;
+            count = size - offset < count ? size - offset : count;
+            size_t toBoundary = 0x10000 - (lineAddress & 0xFFFF);
+            count = toBoundary < count ? toBoundary : count;
+            fn(lineAddress, offset, count, first || (lineAddress & 0xFFFF) == 0);
+            first = false;
+            offset += count;
+        }
+    }
+};
+
+// Motorola S-records, the address width is chosen from the highest address
+// so the whole element uses S1, S2 or S3 data records
+class SRecord {
+public:
+    static void Encode(uint32_t address, ByteSpan data, size_t recordSize, std::vector<char>& out) {
+        uint64_t last = data.empty() ? address : address + (uint64_t)data.size() - 1;
+        size_t addressSize = last <= 0xFFFF ? 2 : last <= 0xFFFFFF ? 3 : 4;
+        char dataType = (char)('0' + addressSize - 1);
+        char endType = (char)('0' + 11 - addressSize);
+        size_t records = (data.size() + recordSize - 1) / recordSize;
+        size_t countSize = records <= 0xFFFF ? 2 : 3;
+
+        // Plan the line lengths so the output is sized exactly once
+        size_t full = data.size() / recordSize;
+        size_t tail = data.size() % recordSize;
+        size_t length = LineLength(2, 0)
+            + full * LineLength(addressSize, recordSize)
+            + (tail ? LineLength(addressSize, tail) : 0)
+            + LineLength(countSize, 0)
+            + LineLength(addressSize, 0);
+
+        size_t start = out.size();
+        out.resize(start + length);
+        char* position = out.data() + start;
+        position = Record(position, '0', 0, 2, nullptr, 0);
+        for (size_t offset = 0; offset < data.size(); offset += recordSize) {
+            size_t count = data.size() - offset < recordSize ? data.size() - offset : recordSize;
+            position = Record(position, dataType, address + (uint32_t)offset, addressSize, data.data() + offset, count);
+        }
+        position = Record(position, countSize == 2 ? '5' : '6', (uint32_t)records, countSize, nullptr, 0);
+        Record(position, endType, 0, addressSize, nullptr, 0);
+    }
+
+    static size_t LineLength(size_t addressSize, size_t count) {
+        return 2 + 2 * (1 + addressSize + count + 1) + 1;
+    }
+
+    static char* Record(char* out, char type, uint32_t address, size_t addressSize, const uint8_t* data, size_t count) {
+        uint8_t header[5];
+        header[0] = (uint8_t)(addressSize + count + 1);
+        for (size_t i = 0; i < addressSize; i++) {
+            header[1 + i] = (uint8_t)(address >> (8 * (addressSize - 1 - i)));
+        }
+        *out++ = 'S';
+        *out++ = type;
+        EncodeHex(header, 1 + addressSize, out);
+        out += 2 * (1 + addressSize);
+        EncodeHex(data, count, out);
+        out += 2 * count;
+        uint8_t checksum = (uint8_t)~(ByteSum(header, 1 + addressSize) + ByteSum(data, count));
+        EncodeHex(&checksum, 1, out);
+        out += 2;
+        *out++ = '\n';
+        return out;
+    }
+};
+
+// UF2 block format, 512 byte blocks each carrying up to 476 payload bytes
+//   I   uint32_t    magicStart0     0x0A324655
+//   I   uint32_t    magicStart1     0x9E5D5157
+//   I   uint32_t    flags           0x2000 when familyID is present
+//   I   uint32_t    targetAddr
+//   I   uint32_t    payloadSize
+//   I   uint32_t    blockNo
+//   I   uint32_t    numBlocks
+//   I   uint32_t    familyID
+//   476s            data
+//   I   uint32_t    magicEnd        0x0AB16F30
+class Uf2 {
+public:
+    static const size_t BlockSize = 512;
+    static const uint32_t MagicStart0 = 0x0A324655;
+    static const uint32_t MagicStart1 = 0x9E5D5157;
+    static const uint32_t MagicEnd = 0x0AB16F30;
+    static const uint32_t FlagNotMainFlash = 0x00000001;
+    static const uint32_t FlagFamilyId = 0x00002000;
+    // Blocks handed to one thread at a time
+    static const size_t BlocksPerTask = 4096;
+
+    static void Encode(uint32_t address, ByteSpan data, uint32_t payloadSize, uint32_t familyId, std::vector<char>& out) {
+        size_t blocks = (data.size() + payloadSize - 1) / payloadSize;
+        size_t start = out.size();
+        out.resize(start + blocks * BlockSize);
+        char* base = out.data() + start;
+
+        auto encodeRange = [&](size_t task) {
+            size_t last = (task + 1) * BlocksPerTask < blocks ? (task + 1) * BlocksPerTask : blocks;
+            for (size_t block = task * BlocksPerTask; block < last; block++) {
+                size_t offset = block * payloadSize;
+                uint32_t size = (uint32_t)(data.size() - offset < payloadSize ? data.size() - offset : payloadSize);
+                uint32_t header[8] = { MagicStart0, MagicStart1, familyId ? FlagFamilyId : 0,
+                                       address + (uint32_t)offset, size, (uint32_t)block, (uint32_t)blocks, familyId };
+                char* encoded = base + block * BlockSize;
+                std::memcpy(encoded, header, sizeof(header));
+                std::memcpy(encoded + 32, data.data() + offset, size);
+                std::memset(encoded + 32 + size, 0, 476 - size);
+                std::memcpy(encoded + 508, &MagicEnd, 4);
+            }
+        };
+
+        size_t tasks = (blocks + BlocksPerTask - 1) / BlocksPerTask;
+        if (tasks > 1) {
+            ThreadPool::Shared().ParallelFor(tasks, encodeRange);
+        } else if (tasks == 1) {
+            encodeRange(0);
+        }
+    }
+};
+
+// FIPS 180-4 SHA-256
+class Sha256 {
+public:
+    Sha256() { Reset(); }
+
+    void Reset() {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        std::memcpy(m_state, initial, sizeof(m_state));
+        m_length = 0;
+        m_used = 0;
+    }
+
+    void Update(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        m_length += size;
+        if (m_used > 0) {
+            size_t count = 64 - m_used < size ? 64 - m_used : size;
+            std::memcpy(m_block + m_used, bytes, count);
+            m_used += count;
+            bytes += count;
+            size -= count;
+            if (m_used < 64) {
+                return;
+            }
+            Transform(m_block);
+            m_used = 0;
+        }
+        while (size >= 64) {
+            Transform(bytes);
+            bytes += 64;
+            size -= 64;
+        }
+        std::memcpy(m_block, bytes, size);
+        m_used = size;
+    }
+
+    std::array<uint8_t, 32> Final() {
+        uint64_t bits = m_length * 8;
+        uint8_t pad[72] = { 0x80 };
+        size_t padding = (m_used < 56 ? 56 : 120) - m_used;
+        for (int i = 0; i < 8; i++) {
+            pad[padding + i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        Update(pad, padding + 8);
+        std::array<uint8_t, 32> digest;
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = (uint8_t)(m_state[i] >> 24);
+            digest[4 * i + 1] = (uint8_t)(m_state[i] >> 16);
+            digest[4 * i + 2] = (uint8_t)(m_state[i] >> 8);
+            digest[4 * i + 3] = (uint8_t)m_state[i];
+        }
+        Reset();
+        return digest;
+    }
+
+private:
+    static uint32_t Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void Transform(const uint8_t* block) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+                 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+        m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+    }
+
+    uint32_t m_state[8];
+    uint8_t m_block[64];
+    uint64_t m_length;
+    size_t m_used;
+};
+
+} // namespace detail
+
+// Destinations the writers can target instead of a std::ofstream
+namespace sink {
+
+class Sink {
+public:
+    virtual ~Sink() {}
+    virtual bool Write(const void* data, size_t size) =0;
+    // Several buffers in order, sinks which can batch them override this
+    virtual bool Write(const std::vector<ByteSpan>& segments) {
+        for (const ByteSpan& segment : segments) {
+            if (!Write(segment.data(), segment.size())) {
+                return false;
+            }
+        }
+        return true;
+    }
+    virtual bool Flush() { return true; }
+};
+
+// Appends to a caller owned buffer
+class Memory : public Sink {
+public:
+    Memory(std::vector<uint8_t>& out) : m_out(out) {}
+    virtual bool Write(const void* data, size_t size) override {
+        m_out.insert(m_out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+        return true;
+    }
+    virtual bool Write(const std::vector<ByteSpan>& segments) override {
+        size_t total = m_out.size();
+        for (const ByteSpan& segment : segments) {
+            total += segment.size();
+        }
+        m_out.reserve(total);
+        return Sink::Write(segments);
+    }
+private:
+    std::vector<uint8_t>& m_out;
+};
+
+// Forwards to a function, returning false from it stops the writer
+class Callback : public Sink {
+public:
+    typedef std::function<bool(const void* data, size_t size)> WriteFunction;
+    Callback(WriteFunction write) : m_write(write) {}
+    virtual bool Write(const void* data, size_t size) override { return m_write(data, size); }
+private:
+    WriteFunction m_write;
+};
+
+// Adapter for existing iostream code
+class Stream : public Sink {
+public:
+    Stream(std::ostream& out) : m_out(out) {}
+    virtual bool Write(const void* data, size_t size) override {
+        m_out.write((const char*)data, size);
+        return (bool)m_out;
+    }
+    virtual bool Flush() override { return (bool)m_out.flush(); }
+private:
+    std::ostream& m_out;
+};
+
+#if !defined(_WIN32)
+// Raw descriptor. Small writes are collected in a page aligned buffer and
+// written in large blocks, large writes and segment lists go straight to
+// write/writev.
+class Fd : public Sink {
+public:
+    static const size_t BufferSize = 1024 * 1024;
+    static const size_t Alignment = 4096;
+
+    Fd(int fd, bool closeOnDestroy = false) : m_fd(fd), m_close(closeOnDestroy) {}
+    ~Fd() {
+        Close();
+        ::operator delete(m_buffer, std::align_val_t(Alignment));
+    }
+
+    bool IsOpen() const { return m_fd >= 0; }
+
+    virtual bool Write(const void* data, size_t size) override {
+        if (m_used + size > BufferSize && !Flush()) {
+            return false;
+        }
+        if (size >= BufferSize) {
+            return WriteAll(data, size);
+        }
+        if (!m_buffer) {
+            m_buffer = (uint8_t*)::operator new(BufferSize, std::align_val_t(Alignment));
+        }
+        std::memcpy(m_buffer + m_used, data, size);
+        m_used += size;
+        return true;
+    }
+
+    virtual bool Write(const std::vector<ByteSpan>& segments) override {
+        if (!Flush()) {
+            return false;
+        }
+        m_ok = m_fd >= 0 && detail::WriteAll(m_fd, segments);
+        return m_ok;
+    }
+
+    virtual bool Flush() override {
+        if (m_used > 0) {
+            size_t used = m_used;
+            m_used = 0;
+            WriteAll(m_buffer, used);
+        }
+        return m_ok;
+    }
+
+    // Flushes and closes the descriptor if owned, false if anything failed
+    bool Close() {
+        bool ok = m_fd >= 0 && Flush();
+        if (m_close && m_fd >= 0 && ::close(m_fd) != 0) {
+            ok = false;
+        }
+        m_fd = -1;
+        return ok;
+    }
+
+private:
+    bool WriteAll(const void* data, size_t size) {
+        m_ok = m_ok && m_fd >= 0 && detail::WriteAll(m_fd, std::vector<ByteSpan>(1, ByteSpan((const uint8_t*)data, size)));
+        return m_ok;
+    }
+
+    int m_fd;
+    bool m_close;
+    bool m_ok = true;
+    uint8_t* m_buffer = nullptr;
+    size_t m_used = 0;
+};
+
+// Creates or truncates a file and writes it through an Fd sink
+class File : public Fd {
+public:
+    File(const std::string& filename)
+        : Fd(::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), true) {}
+};
+#else
+class File : public Sink {
+public:
+    File(const std::string& filename) : m_out(filename, std::ofstream::binary) {}
+    bool IsOpen() const { return m_out.is_open(); }
+    virtual bool Write(const void* data, size_t size) override {
+        m_out.write((const char*)data, size);
+        return (bool)m_out;
+    }
+    virtual bool Flush() override { return (bool)m_out.flush(); }
+    bool Close() {
+        m_out.close();
+        return (bool)m_out;
+    }
+private:
+    std::ofstream m_out;
+};
+#endif
+
+} // namespace sink
+
+namespace writer {
+
+class FileWriter {
+public:
+    FileWriter() {}
+    virtual ~FileWriter() {}
+    virtual bool Write(sink::Sink& out, const DFUTarget& target) =0;
+    virtual std::unique_ptr<FileWriter> Clone() =0;
+    // Upper bound of the memory Write holds for target: the payload plus
+    // any encoded output built before it goes to the sink
+    virtual uint64_t BufferSize(const DFUTarget& target) const { return (uint64_t)target.Size(); }
+
+    void Write(std::ofstream& out, const DFUTarget& target) {
+        sink::Stream stream(out);
+        Write(stream, target);
+    }
+};
+
+class BinWriter : public FileWriter {
+public:
+    BinWriter() { }
+    using FileWriter::Write;
+    virtual bool Write(sink::Sink& out, const DFUTarget& target) override {
+        return out.Write(target.Data().data(), target.Data().size());
+    }
+    virtual std::unique_ptr<FileWriter> Clone() override {return std::make_unique<BinWriter>( *this ); }
+};
+
+// Intel HEX with extended linear address records, recordSize data bytes per line
+class HexWriter : public FileWriter {
+public:
+    HexWriter(uint8_t recordSize = 16) : m_recordSize(recordSize ? recordSize : 16) { }
+    using FileWriter::Write;
+    virtual bool Write(sink::Sink& out, const DFUTarget& target) override {
+        std::vector<char> text;
+        detail::IntelHex::Encode(target.Address(), target.Data(), m_recordSize, text);
+        return out.Write(text.data(), text.size());
+    }
+    virtual uint64_t BufferSize(const DFUTarget& target) const override {
+        uint64_t size = (uint64_t)target.Size();
+        uint64_t lines = size / m_recordSize + size / 0x10000 + 2;
+        return size + lines * (detail::IntelHex::BaseLength + 12 + 2 * m_recordSize) + detail::IntelHex::EofLength;
+    }
+    virtual std::unique_ptr<FileWriter> Clone() override {return std::make_unique<HexWriter>( *this ); }
+private:
+    uint8_t m_recordSize;
+};
+
+// Motorola S-records (S19, S28 or S37 depending on the highest address)
+class SRecWriter : public FileWriter {
+public:
+    SRecWriter(uint8_t recordSize = 16) : m_recordSize(recordSize ? recordSize : 16) { }
+    using FileWriter::Write;
+    virtual bool Write(sink::Sink& out, const DFUTarget& target) override {
+        std::vector<char> text;
+        detail::SRecord::Encode(target.Address(), target.Data(), m_recordSize, text);
+        return out.Write(text.data(), text.size());
+    }
+    virtual uint64_t BufferSize(const DFUTarget& target) const override {
+        uint64_t size = (uint64_t)target.Size();
+        return size + (size / m_recordSize + 4) * detail::SRecord::LineLength(4, m_recordSize);
+    }
+    virtual std::unique_ptr<FileWriter> Clone() override {return std::make_unique<SRecWriter>( *this ); }
+private:
+    uint8_t m_recordSize;
+};
+
+// UF2 blocks of payloadSize bytes, familyId 0 leaves the family field unset
+class Uf2Writer : public FileWriter {
+public:
+    Uf2Writer(uint32_t familyId = 0, uint32_t payloadSize = 256)
+        : m_familyId(familyId), m_payloadSize(payloadSize && payloadSize <= 476 ? payloadSize : 256) { }
+    using FileWriter::Write;
+    virtual bool Write(sink::Sink& out, const DFUTarget& target) override {
+        std::vector<char> blocks;
+        detail::Uf2::Encode(target.Address(), target.Data(), m_payloadSize, m_familyId, blocks);
+        return out.Write(blocks.data(), blocks.size());
+    }
+    virtual uint64_t BufferSize(const DFUTarget& target) const override {
+        uint64_t size = (uint64_t)target.Size();
+        return size + (size / m_payloadSize + 1) * detail::Uf2::BlockSize;
+    }
+    virtual std::unique_ptr<FileWriter> Clone() override {return std::make_unique<Uf2Writer>( *this ); }
+private:
+    uint32_t m_familyId;
+    uint32_t m_payloadSize;
+};
+
+inline BinWriter Bin;
+inline HexWriter Hex;
+inline SRecWriter SRec;
+inline Uf2Writer Uf2;
+
+// Streaming counterparts of the writers for FanOut. A stage sees an element
+// as Begin(target), Chunk(data) for consecutive slices of the payload and
+// End(), each returning false on failure. Output is identical to the
+// matching FileWriter.
+class BinStage {
+public:
+    BinStage(sink::Sink& out) : m_out(&out) { }
+    bool Begin(const DFUTarget&) { return true; }
+    bool Chunk(ByteSpan data) { return m_out->Write(data.data(), data.size()); }
+    bool End() { return true; }
+private:
+    sink::Sink* m_out;
+};
+
+// Collects whole records across chunk boundaries, lines are broken exactly
+// where the one-shot encoders break them
+class LineStage {
+protected:
+    LineStage(sink::Sink& out, size_t recordSize) : m_out(&out), m_recordSize(recordSize ? recordSize : 16) { }
+
+    template <typename Capacity, typename Emit>
+    void Lines(ByteSpan data, Capacity capacity, Emit emit) {
+        const uint8_t* bytes = data.data();
+        size_t size = data.size();
+        while (size > 0) {
+            size_t lineSize = capacity();
+            if (m_pending.empty() && size >= lineSize) {
+                emit(bytes, lineSize);
+                bytes += lineSize;
+                size -= lineSize;
+                continue;
+            }
+            size_t count = lineSize - m_pending.size() < size ? lineSize - m_pending.size() : size;
+            m_pending.insert(m_pending.end(), bytes, bytes + count);
+            bytes += count;
+            size -= count;
+            if (m_pending.size() == lineSize) {
+                emit(m_pending.data(), lineSize);
+                m_pending.clear();
+            }
+        }
+    }
+
+    char* Reserve(size_t size) {
+        size_t used = m_text.size();
+        m_text.resize(used + size);
+        return m_text.data() + used;
+    }
+    void Commit(char* end) { m_text.resize(end - m_text.data()); }
+
+    bool Flush() {
+        bool ok = m_out->Write(m_text.data(), m_text.size());
+        m_text.clear();
+        return ok;
+    }
+
+    sink::Sink* m_out;
+    size_t m_recordSize;
+    std::vector<uint8_t> m_pending;
+    std::vector<char> m_text;
+};
+
+class HexStage : public LineStage {
+public:
+    HexStage(sink::Sink& out, uint8_t recordSize = 16) : LineStage(out, recordSize) { }
+
+    bool Begin(const DFUTarget& target) {
+        m_address = target.Address();
+        m_first = true;
+        m_pending.clear();
+        m_text.clear();
+        return true;
+    }
+    bool Chunk(ByteSpan data) {
+        Lines(data, [this] {
+            size_t toBoundary = 0x10000 - (m_address & 0xFFFF);
+            return toBoundary < m_recordSize ? toBoundary : m_recordSize;
+        }, [this](const uint8_t* line, size_t count) { Emit(line, count); });
+        return Flush();
+    }
+    bool End() {
+        if (!m_pending.empty()) {
+            Emit(m_pending.data(), m_pending.size());
+            m_pending.clear();
+        }
+        Commit(detail::IntelHex::Record(Reserve(detail::IntelHex::EofLength), 0x01, 0, nullptr, 0));
+        return Flush();
+    }
+
+private:
+    void Emit(const uint8_t* data, size_t count) {
+        char* out = Reserve(detail::IntelHex::BaseLength + 12 + 2 * count);
+        if (m_first || (m_address & 0xFFFF) == 0) {
+            uint8_t base[2] = { (uint8_t)(m_address >> 24), (uint8_t)(m_address >> 16) };
+            out = detail::IntelHex::Record(out, 0x04, 0, base, 2);
+            m_first = false;
+        }
+        Commit(detail::IntelHex::Record(out, 0x00, (uint16_t)m_address, data, count));
+        m_address += (uint32_t)count;
+    }
+
+    uint32_t m_address = 0;
+    bool m_first = true;
+};
+
+class SRecStage : public LineStage {
+public:
+    SRecStage(sink::Sink& out, uint8_t recordSize = 16) : LineStage(out, recordSize) { }
+
+    bool Begin(const DFUTarget& target) {
+        uint64_t last = target.Size() ? target.Address() + (uint64_t)target.Size() - 1 : target.Address();
+        m_addressSize = last <= 0xFFFF ? 2 : last <= 0xFFFFFF ? 3 : 4;
+        m_address = target.Address();
+        m_records = 0;
+        m_pending.clear();
+        m_text.clear();
+        Commit(detail::SRecord::Record(Reserve(detail::SRecord::LineLength(2, 0)), '0', 0, 2, nullptr, 0));
+        return true;
+    }
+    bool Chunk(ByteSpan data) {
+        Lines(data, [this] { return m_recordSize; },
+              [this](const uint8_t* line, size_t count) { Emit(line, count); });
+        return Flush();
+    }
+    bool End() {
+        if (!m_pending.empty()) {
+            Emit(m_pending.data(), m_pending.size());
+            m_pending.clear();
+        }
+        size_t countSize = m_records <= 0xFFFF ? 2 : 3;
+        char* out = Reserve(detail::SRecord::LineLength(countSize, 0) + detail::SRecord::LineLength(m_addressSize, 0));
+        out = detail::SRecord::Record(out, countSize == 2 ? '5' : '6', (uint32_t)m_records, countSize, nullptr, 0);
+        Commit(detail::SRecord::Record(out, (char)('0' + 11 - m_addressSize), 0, m_addressSize, nullptr, 0));
+        return Flush();
+    }
+
+private:
+    void Emit(const uint8_t* data, size_t count) {
+        char* out = Reserve(detail::SRecord::LineLength(m_addressSize, count));
+        Commit(detail::SRecord::Record(out, (char)('0' + m_addressSize - 1), m_address, m_addressSize, data, count));
+        m_address += (uint32_t)count;
+        m_records++;
+    }
+
+    size_t m_addressSize = 4;
+    uint32_t m_address = 0;
+    size_t m_records = 0;
+};
+
+// SHA-256 of the element payload
+class Sha256Stage {
+public:
+    Sha256Stage(std::array<uint8_t, 32>& digest) : m_digest(&digest) { }
+    bool Begin(const DFUTarget&) { m_sha.Reset(); return true; }
+    bool Chunk(ByteSpan data) { m_sha.Update(data.data(), data.size()); return true; }
+    bool End() { *m_digest = m_sha.Final(); return true; }
+private:
+    detail::Sha256 m_sha;
+    std::array<uint8_t, 32>* m_digest;
+};
+
+// Reads each element payload once, in cache sized chunks, and feeds every
+// chunk to all stages before moving on. Stages are a compile time list so
+// the per chunk calls are resolved statically.
+//
+//     writer::BinStage bin(binSink);
+//     writer::HexStage hex(hexSink);
+//     writer::Sha256Stage sha(digest);
+//     writer::FanOut fan(bin, hex, sha);
+//     fan.Write(target);
+template <typename... Stages>
+class FanOut {
+public:
+    FanOut(Stages... stages) : m_stages(std::move(stages)...) { }
+
+    bool Write(const DFUTarget& target, size_t chunkSize = 64 * 1024) {
+        ByteSpan data = target.Data();
+        bool ok = Each([&](auto& stage) { return stage.Begin(target); });
+        for (size_t offset = 0; ok && offset < data.size(); offset += chunkSize) {
+            ByteSpan chunk(data.data() + offset, data.size() - offset < chunkSize ? data.size() - offset : chunkSize);
+            ok = Each([&](auto& stage) { return stage.Chunk(chunk); });
+        }
+        return ok && Each([&](auto& stage) { return stage.End(); });
+    }
+
+private:
+    template <typename Fn>
+    bool Each(Fn fn) {
+        return std::apply([&](Stages&... stages) {
+            bool ok = true;
+            ((ok = fn(stages) && ok), ...);
+            return ok;
+        }, m_stages);
+    }
+
+    std::tuple<Stages...> m_stages;
+};
+
+} // namespace writer
+
+namespace reader {
+
+namespace detail {
+
+// Collects runs of data in the order records arrive and turns them into
+// elements, contiguous runs are merged and overlaps rejected
+class ElementRuns {
+public:
+    void Append(uint32_t address, const uint8_t* data, size_t size) {
+        if (m_runs.empty() || m_runs.back().first + m_runs.back().second.size() != address) {
+            m_runs.emplace_back(address, std::vector<uint8_t>());
+        }
+        m_runs.back().second.insert(m_runs.back().second.end(), data, data + size);
+    }
+
+    bool Finish(std::vector<DFUTarget>& elements) {
+        std::stable_sort(m_runs.begin(), m_runs.end(), [](const Run& a, const Run& b) { return a.first < b.first; });
+        std::vector<Run> merged;
+        for (Run& run : m_runs) {
+            if (!merged.empty()) {
+                uint64_t end = merged.back().first + (uint64_t)merged.back().second.size();
+                if (run.first < end) {
+                    return false;
+                }
+                if (run.first == end) {
+                    merged.back().second.insert(merged.back().second.end(), run.second.begin(), run.second.end());
+                    continue;
+                }
+            }
+            merged.push_back(std::move(run));
+        }
+        for (Run& run : merged) {
+            elements.emplace_back(run.first, std::move(run.second));
+        }
+        m_runs.clear();
+        return true;
+    }
+
+private:
+    typedef std::pair<uint32_t, std::vector<uint8_t>> Run;
+    std::vector<Run> m_runs;
+};
+
+} // namespace detail
+
+// Parse Intel HEX text into elements, one per contiguous address range.
+// Returns false on malformed records, bad checksums or a missing end of file
+// record, so a truncated file is not mistaken for a complete image. Anything
+// after the end of file record is ignored.
+inline bool ReadHex(ByteSpan text, std::vector<DFUTarget>& elements) {
+    const char* position = (const char*)text.data();
+    const char* end = position + text.size();
+    detail::ElementRuns runs;
+    uint32_t base = 0;
+    uint8_t record[4 + 255 + 1];
+
+    while (position < end) {
+        if (*position != ':') {
+            if (*position == '\r' || *position == '\n' || *position == ' ' || *position == '\t') {
+                position++;
+                continue;
+            }
+            return false;
+        }
+        position++;
+        if (end - position < 10 || !::dfuse::detail::DecodeHex(position, 1, record)) {
+            return false;
+        }
+        size_t length = 4 + record[0] + 1;
+        if ((size_t)(end - position) < 2 * length || !::dfuse::detail::DecodeHex(position, length, record)) {
+            return false;
+        }
+        position += 2 * length;
+        if (::dfuse::detail::ByteSum(record, length) != 0) {
+            return false;
+        }
+
+        uint8_t count = record[0];
+        uint16_t address = (uint16_t)(record[1] << 8 | record[2]);
+        const uint8_t* data = record + 4;
+        switch (record[3]) {
+        case 0x00:
+            runs.Append(base + address, data, count);
+            break;
+        case 0x01:
+            return runs.Finish(elements);
+        case 0x02:
+            if (count != 2) return false;
+            base = (uint32_t)(data[0] << 8 | data[1]) << 4;
+            break;
+        case 0x04:
+            if (count != 2) return false;
+            base = (uint32_t)(data[0] << 8 | data[1]) << 16;
+            break;
+        case 0x03:
+        case 0x05:
+            // Start addresses do not describe memory contents
+            break;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+inline bool ReadHex(const char* filename, std::vector<DFUTarget>& elements) {
+    auto file = ::dfuse::detail::MappedFile::Open(filename);
+    if (!file) {
+        return false;
+    }
+    return ReadHex(ByteSpan(file->Data(), file->Size()), elements);
+}
+
+// Parse Motorola S-records into elements, one per contiguous address range.
+// Returns false on malformed records or bad checksums.
+inline bool ReadSRec(ByteSpan text, std::vector<DFUTarget>& elements) {
+    const char* position = (const char*)text.data();
+    const char* end = position + text.size();
+    detail::ElementRuns runs;
+    uint8_t record[256];
+
+    while (position < end) {
+        if (*position != 'S') {
+            if (*position == '\r' || *position == '\n' || *position == ' ' || *position == '\t') {
+                position++;
+                continue;
+            }
+            return false;
+        }
+        if (end - position < 4) {
+            return false;
+        }
+        char type = position[1];
+        position += 2;
+        if (!::dfuse::detail::DecodeHex(position, 1, record)) {
+            return false;
+        }
+        size_t length = 1 + record[0];
+        if ((size_t)(end - position) < 2 * length || !::dfuse::detail::DecodeHex(position, length, record)) {
+            return false;
+        }
+        position += 2 * length;
+        if (::dfuse::detail::ByteSum(record, length) != 0xFF) {
+            return false;
+        }
 
-        // We will stream in the elements later, save the stream location
-        obj.m_elements.resize(obj.m_prefix.Size);
-        in.read((char*)obj.m_elements.data(), obj.m_prefix.Size);
+        size_t addressSize = 0;
+        if (type == '1' || type == '2' || type == '3') {
+            addressSize = type - '0' + 1;
+        } else if (type >= '0' && type <= '9' && type != '4') {
+            // Header, count and start address records
+            continue;
+        } else {
+            return false;
+        }
+        if (record[0] < addressSize + 1) {
+            return false;
+        }
+        uint32_t address = 0;
+        for (size_t i = 0; i < addressSize; i++) {
+            address = address << 8 | record[1 + i];
+        }
+        runs.Append(address, record + 1 + addressSize, record[0] - addressSize - 1);
+    }
+    return runs.Finish(elements);
+}
 
-        //in.seekg(obj.m_prefix.Size, std::ios_base::cur);
+inline bool ReadSRec(const char* filename, std::vector<DFUTarget>& elements) {
+    auto file = ::dfuse::detail::MappedFile::Open(filename);
+    if (!file) {
+        return false;
+    }
+    return ReadSRec(ByteSpan(file->Data(), file->Size()), elements);
+}
 
-        return in;
+// Reassemble UF2 blocks into elements, one per contiguous address range.
+// familyId 0 accepts every block, otherwise blocks of other families are
+// skipped. Blocks are validated and copied in parallel for large files.
+inline bool ReadUf2(ByteSpan data, std::vector<DFUTarget>& elements, uint32_t familyId = 0) {
+    typedef ::dfuse::detail::Uf2 Uf2;
+    if (data.size() % Uf2::BlockSize != 0) {
+        return false;
     }
-    struct Prefix {
+    size_t blocks = data.size() / Uf2::BlockSize;
+    size_t tasks = (blocks + Uf2::BlocksPerTask - 1) / Uf2::BlocksPerTask;
+
+    struct Block {
         uint32_t Address;
         uint32_t Size;
+        size_t Index;
+    };
+    std::vector<Block> found(blocks);
+    std::atomic<bool> valid(true);
+    auto parse = [&](size_t task) {
+        size_t last = (task + 1) * Uf2::BlocksPerTask < blocks ? (task + 1) * Uf2::BlocksPerTask : blocks;
+        for (size_t i = task * Uf2::BlocksPerTask; i < last; i++) {
+            uint32_t header[8];
+            uint32_t magicEnd;
+            const uint8_t* block = data.data() + i * Uf2::BlockSize;
+            std::memcpy(header, block, sizeof(header));
+            std::memcpy(&magicEnd, block + 508, 4);
+            found[i].Size = 0;
+            if (header[0] != Uf2::MagicStart0 || header[1] != Uf2::MagicStart1
+                || magicEnd != Uf2::MagicEnd || header[4] > 476) {
+                valid = false;
+                return;
+            }
+            bool otherFamily = familyId && (!(header[2] & Uf2::FlagFamilyId) || header[7] != familyId);
+            if ((header[2] & Uf2::FlagNotMainFlash) || otherFamily) {
+                continue;
+            }
+            found[i].Address = header[3];
+            found[i].Size = header[4];
+            found[i].Index = i;
+        }
+    };
+    if (tasks > 1) {
+        ::dfuse::detail::ThreadPool::Shared().ParallelFor(tasks, parse);
+    } else if (tasks == 1) {
+        parse(0);
+    }
+    if (!valid) {
+        return false;
+    }
 
-        friend std::istream & operator >> (std::istream &in,  Prefix &obj) {
-            //   <   little endian
-            //   I   uint32_t    element address
-            //   I   uint32_t    element size
-            in.read((char*)&obj.Address, 4);
-            in.read((char*)&obj.Size, 4);
-            return in;
+    found.erase(std::remove_if(found.begin(), found.end(), [](const Block& b) { return b.Size == 0; }), found.end());
+    std::sort(found.begin(), found.end(), [](const Block& a, const Block& b) { return a.Address < b.Address; });
+
+    // Size every element first, then fill them all at once
+    struct Range {
+        size_t First;
+        size_t Last;
+        uint64_t Size;
+    };
+    std::vector<Range> ranges;
+    for (size_t i = 0; i < found.size(); i++) {
+        if (!ranges.empty()) {
+            const Block& previous = found[ranges.back().Last];
+            uint64_t end = (uint64_t)previous.Address + previous.Size;
+            if (found[i].Address < end) {
+                return false;
+            }
+            if (found[i].Address == end) {
+                ranges.back().Last = i;
+                ranges.back().Size += found[i].Size;
+                continue;
+            }
+        }
+        ranges.push_back({i, i, found[i].Size});
+    }
+
+    std::vector<std::vector<uint8_t>> payloads(ranges.size());
+    std::vector<size_t> rangeOf(found.size());
+    for (size_t r = 0; r < ranges.size(); r++) {
+        payloads[r].resize(ranges[r].Size);
+        for (size_t i = ranges[r].First; i <= ranges[r].Last; i++) {
+            rangeOf[i] = r;
+        }
+    }
+    auto copy = [&](size_t task) {
+        size_t last = (task + 1) * Uf2::BlocksPerTask < found.size() ? (task + 1) * Uf2::BlocksPerTask : found.size();
+        for (size_t i = task * Uf2::BlocksPerTask; i < last; i++) {
+            const Range& range = ranges[rangeOf[i]];
+            size_t offset = found[i].Address - found[range.First].Address;
+            std::memcpy(payloads[rangeOf[i]].data() + offset, data.data() + found[i].Index * Uf2::BlockSize + 32, found[i].Size);
         }
     };
-    Prefix m_prefix;
-    std::vector<uint8_t> m_elements;
-};
+    size_t copyTasks = (found.size() + Uf2::BlocksPerTask - 1) / Uf2::BlocksPerTask;
+    if (copyTasks > 1) {
+        ::dfuse::detail::ThreadPool::Shared().ParallelFor(copyTasks, copy);
+    } else if (copyTasks == 1) {
+        copy(0);
+    }
 
-namespace writer {
+    for (size_t r = 0; r < ranges.size(); r++) {
+        elements.emplace_back(found[ranges[r].First].Address, std::move(payloads[r]));
+    }
+    return true;
+}
 
-class FileWriter {
-public:
-    FileWriter() {}
-    virtual void Write(std::ofstream& out, const DFUTarget& target) =0;
-    virtual std::unique_ptr<FileWriter> Clone() =0;
-};
+inline bool ReadUf2(const char* filename, std::vector<DFUTarget>& elements, uint32_t familyId = 0) {
+    auto file = ::dfuse::detail::MappedFile::Open(filename);
+    if (!file) {
+        return false;
+    }
+    return ReadUf2(ByteSpan(file->Data(), file->Size()), elements, familyId);
+}
 
-class BinWriter : public FileWriter {
-public:
-    BinWriter() { }
-    virtual void Write(std::ofstream& out, const DFUTarget& target) override {
-        out.write((const char*)target.Data().data(), target.Data().size());
+// Turn the PT_LOAD segments of a 32 or 64 bit little endian ELF file into
+// elements at their physical (load) addresses. The file is mapped and the
+// elements reference it, segments which are contiguous in memory are merged
+// and only copied if they are not also contiguous in the file.
+inline bool ReadElf(const char* filename, std::vector<DFUTarget>& elements) {
+    auto file = ::dfuse::detail::MappedFile::Open(filename);
+    if (!file || file->Size() < 52) {
+        return false;
     }
-    virtual std::unique_ptr<FileWriter> Clone() override {return std::make_unique<BinWriter>( *this ); }
-};
+    const uint8_t* data = file->Data();
+    uint64_t fileSize = file->Size();
 
-BinWriter Bin;
+    //   e_ident  0x7F 'E' 'L' 'F', class (1 = 32 bit, 2 = 64 bit), data (1 = little endian)
+    if (std::memcmp(data, "\x7F" "ELF", 4) != 0 || data[5] != 1 || (data[4] != 1 && data[4] != 2)) {
+        return false;
+    }
+    bool is64 = data[4] == 2;
+    if (is64 && fileSize < 64) {
+        return false;
+    }
 
-} // namespace writer
+    auto read16 = [&](uint64_t offset) { uint16_t v; std::memcpy(&v, data + offset, 2); return (uint64_t)v; };
+    auto read32 = [&](uint64_t offset) { uint32_t v; std::memcpy(&v, data + offset, 4); return (uint64_t)v; };
+    auto read64 = [&](uint64_t offset) { uint64_t v; std::memcpy(&v, data + offset, 8); return v; };
+
+    uint64_t phoff = is64 ? read64(32) : read32(28);
+    uint64_t phentsize = is64 ? read16(54) : read16(42);
+    uint64_t phnum = is64 ? read16(56) : read16(44);
+    if (phentsize < (is64 ? 56u : 32u) || phoff > fileSize || phnum * phentsize > fileSize - phoff) {
+        return false;
+    }
+
+    struct Segment {
+        uint64_t Address;
+        uint64_t Offset;
+        uint64_t Size;
+    };
+    std::vector<Segment> segments;
+    for (uint64_t i = 0; i < phnum; i++) {
+        uint64_t header = phoff + i * phentsize;
+        const uint32_t PT_LOAD = 1;
+        if (read32(header) != PT_LOAD) {
+            continue;
+        }
+        Segment segment;
+        segment.Offset = is64 ? read64(header + 8) : read32(header + 4);
+        segment.Address = is64 ? read64(header + 24) : read32(header + 12);
+        segment.Size = is64 ? read64(header + 32) : read32(header + 16);
+        if (segment.Size == 0) {
+            // Nothing to program, e.g. .bss
+            continue;
+        }
+        if (segment.Offset > fileSize || segment.Size > fileSize - segment.Offset
+            || segment.Address + segment.Size > 0x100000000ull) {
+            return false;
+        }
+        segments.push_back(segment);
+    }
+
+    std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.Address < b.Address; });
+    for (size_t first = 0; first < segments.size();) {
+        size_t last = first;
+        bool inPlace = true;
+        while (last + 1 < segments.size()) {
+            const Segment& current = segments[last];
+            const Segment& next = segments[last + 1];
+            if (next.Address < current.Address + current.Size) {
+                return false;
+            }
+            if (next.Address != current.Address + current.Size) {
+                break;
+            }
+            inPlace = inPlace && next.Offset == current.Offset + current.Size;
+            last++;
+        }
+
+        uint64_t size = segments[last].Address + segments[last].Size - segments[first].Address;
+        if (inPlace) {
+            elements.push_back(DFUTarget((uint32_t)segments[first].Address, file, segments[first].Offset, (uint32_t)size));
+        } else {
+            std::vector<uint8_t> merged;
+            merged.reserve(size);
+            for (size_t i = first; i <= last; i++) {
+                merged.insert(merged.end(), data + segments[i].Offset, data + segments[i].Offset + segments[i].Size);
+            }
+            elements.emplace_back((uint32_t)segments[first].Address, std::move(merged));
+        }
+        first = last + 1;
+    }
+    return true;
+}
+
+} // namespace reader
 
 class DFUImage {
 public:
-    int Id() { return m_prefix.AltSetting; }
-    const char* Name() { return m_prefix.Name; }
-    int Size() { return m_prefix.Size; }
-    const std::vector<DFUTarget>& Elements() const { return m_targets; }
-    void Write(const std::string filename, const int elementIndex, writer::FileWriter& writer) {
-        std::ofstream outputFile(filename, std::ofstream::binary);
+    DFUImage() = default;
+    DFUImage(const DFUImage&) = default;
+    DFUImage& operator=(const DFUImage&) = default;
+    // A moved-from image is invalid and empty
+    DFUImage(DFUImage&& other) noexcept : m_state(std::move(other.m_state)), m_valid(other.m_valid) {
+        other.Reset();
+    }
+    DFUImage& operator=(DFUImage&& other) noexcept {
+        if (this != &other) {
+            m_state = std::move(other.m_state);
+            m_valid = other.m_valid;
+            other.Reset();
+        }
+        return *this;
+    }
+
+    int Id() const { return m_state->Header.AltSetting; }
+    const char* Name() const { return m_state->Header.Name; }
+    int Size() const { return m_state->Header.Size; }
+    const std::vector<DFUTarget>& Elements() const { return m_state->Targets; }
+    bool Write(const std::string filename, const int elementIndex, writer::FileWriter& writer) const {
+        sink::File outputFile(filename);
+        if (!outputFile.IsOpen()) {
+            return false;
+        }
         auto fw = writer.Clone();
-        fw->Write(outputFile, m_targets[elementIndex]);
-        outputFile.close();
+        const DFUTarget& target = m_state->Targets[elementIndex];
+        bool ok = target.IsReadable() && fw->Write(outputFile, target);
+        return outputFile.Close() && ok;
+    }
+
+    // Same as Write with the Bin writer, without the payload entering user
+    // space when the file was loaded mapped or lazy
+    bool Extract(const std::string filename, const int elementIndex) const {
+        return m_state->Targets[elementIndex].Extract(filename);
+    }
+
+    // Write every element as one contiguous image from the lowest to the
+    // highest element address with gaps filled by fill. Zero filled gaps are
+    // left as holes in a sparse file where supported. Returns false if
+    // elements overlap or the file cannot be written.
+    bool WriteFlat(const std::string filename, uint8_t fill = 0xFF) const {
+        std::vector<const DFUTarget*> sorted;
+        for (const DFUTarget& target : m_state->Targets) {
+            if (!target.IsReadable()) {
+                return false;
+            }
+            if (target.Size() > 0) {
+                sorted.push_back(&target);
+            }
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const DFUTarget* a, const DFUTarget* b) {
+            return a->Address() < b->Address();
+        });
+        for (size_t i = 1; i < sorted.size(); i++) {
+            if (sorted[i]->Address() < (uint64_t)sorted[i - 1]->Address() + sorted[i - 1]->Size()) {
+                return false;
+            }
+        }
+        uint32_t base = sorted.empty() ? 0 : sorted.front()->Address();
+        uint64_t total = sorted.empty() ? 0 : (uint64_t)sorted.back()->Address() + sorted.back()->Size() - base;
+
+        std::vector<uint8_t> pattern(fill != 0x00 ? 1024 * 1024 : 0, fill);
+#if defined(_WIN32)
+        std::ofstream out(filename, std::ofstream::binary);
+        uint64_t position = 0;
+        for (const DFUTarget* target : sorted) {
+            uint64_t gap = target->Address() - base - position;
+            while (gap > 0) {
+                size_t count = gap < 1024 * 1024 ? (size_t)gap : 1024 * 1024;
+                if (pattern.empty()) {
+                    pattern.resize(1024 * 1024, 0);
+                }
+                out.write((const char*)pattern.data(), count);
+                gap -= count;
+            }
+            out.write((const char*)target->Data().data(), target->Data().size());
+            position = (uint64_t)target->Address() - base + target->Size();
+        }
+        out.close();
+        return (bool)out;
+#else
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        // The file starts out as one hole, zero gaps never need writing
+        bool ok = ::ftruncate(fd, total) == 0;
+        auto writeAt = [&](const uint8_t* data, size_t size, uint64_t offset) {
+            while (ok && size > 0) {
+                ssize_t written = ::pwrite(fd, data, size, offset);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    ok = false;
+                    break;
+                }
+                data += written;
+                size -= written;
+                offset += written;
+            }
+        };
+        uint64_t position = 0;
+        for (const DFUTarget* target : sorted) {
+            uint64_t start = target->Address() - base;
+            while (!pattern.empty() && position < start) {
+                size_t count = start - position < pattern.size() ? (size_t)(start - position) : pattern.size();
+                writeAt(pattern.data(), count, position);
+                position += count;
+            }
+            writeAt(target->Data().data(), target->Data().size(), start);
+            position = start + target->Size();
+        }
+        if (::close(fd) != 0) {
+            ok = false;
+        }
+        return ok;
+#endif
     }
 
     operator bool() const {return m_valid;}
@@ -111,25 +2979,42 @@ public:
 private:
     friend std::istream & operator >> (std::istream &in,  DFUImage &obj) {
         obj.m_valid = false;
-        in >> obj.m_prefix;
+        State& state = obj.Mutable();
+        in >> state.Header;
 
-        if (!in || std::memcmp(obj.m_prefix.Signature,"Target",6) != 0) {
+        if (!in || std::memcmp(state.Header.Signature,"Target",6) != 0) {
             return in;
         }
 
-        obj.m_targets.resize(obj.m_prefix.Elements);
-        
-        for (DFUTarget& target : obj.m_targets) {
+        // Grown as prefixes are read, the count in the header is not trusted
+        // to size an allocation. Mapped, lazy and memory sources bound it by
+        // the bytes left, every element needs at least its 8 byte prefix.
+        state.Targets.clear();
+        if (auto source = dynamic_cast<detail::StorageSource*>(in.rdbuf())) {
+            std::streamoff offset = in.tellg();
+            uint64_t size = source->GetStorage()->Size();
+            if (offset < 0 || (uint64_t)offset > size
+                || state.Header.Elements > (size - offset) / 8) {
+                in.setstate(std::ios_base::failbit);
+                return in;
+            }
+            state.Targets.reserve(state.Header.Elements);
+        }
+        for (uint32_t i = 0; i < state.Header.Elements; i++) {
+            DFUTarget target;
             in >> target;
             if (!in) {
                 return in;
             }
+            state.Targets.push_back(std::move(target));
         }
 
         obj.m_valid = true;
         return in;
     }
     struct Prefix {
+        static constexpr size_t Length = 274;
+
         uint8_t Signature[6];
         uint8_t AltSetting;
         uint32_t IsNamed;
@@ -137,6 +3022,15 @@ private:
         uint32_t Size;
         uint32_t Elements;
 
+        void Encode(uint8_t* out) const {
+            std::memcpy(out, Signature, 6);
+            out[6] = AltSetting;
+            std::memcpy(out + 7, &IsNamed, 4);
+            std::memcpy(out + 11, Name, 255);
+            std::memcpy(out + 266, &Size, 4);
+            std::memcpy(out + 270, &Elements, 4);
+        }
+
         friend std::istream & operator >> (std::istream &in,  Prefix &obj) {
             //   <   little endian
             //   6s      char[6]     signature   "Target"
@@ -157,69 +3051,737 @@ private:
             return in;
         }
     };
-    Prefix m_prefix;
-    std::vector<DFUTarget> m_targets;
-    bool m_valid;
+    friend class StreamParser;
+    friend class DFUFile;
+    friend class DFUBuilder;
+
+    // Copies of an image share the header and element list, Mutable()
+    // clones them before a change when they are shared
+    struct State {
+        Prefix Header;
+        std::vector<DFUTarget> Targets;
+    };
+
+    State& Mutable() {
+        if (m_state.use_count() > 1) {
+            m_state = std::make_shared<State>(*m_state);
+        }
+        return *m_state;
+    }
+
+    // Shares one empty state, Mutable() clones it before any change
+    void Reset() noexcept {
+        static const std::shared_ptr<State> empty = std::make_shared<State>();
+        m_state = empty;
+        m_valid = false;
+    }
+
+    std::shared_ptr<State> m_state = std::make_shared<State>();
+    bool m_valid = false;
+};
+
+enum class CrcCheck {
+    NotChecked,
+    Passed,
+    Failed
+};
+
+// Header and suffix fields of a DfuSe file, see Probe()
+struct ProbeResult {
+    bool Valid = false;
+    unsigned int FileFormatVersion = 0;
+    unsigned int Targets = 0;
+    unsigned int Vendor = 0;
+    unsigned int Product = 0;
+    unsigned int DeviceVersion = 0;
+    unsigned int DfuFormat = 0;
+
+    operator bool() const {return Valid;}
+    bool operator!() const {return !Valid;}
 };
 
+namespace detail {
+
+// Expand an export file name pattern. Recognised fields are {alt}, {name},
+// {index}, {addr} (decimal), {addr:x} and {addr:X}. Characters in the image
+// name that cannot appear in a file name become '_'.
+inline std::string ExpandPattern(const std::string& pattern, int alt, const char* name, size_t index, uint32_t address) {
+    std::string out;
+    size_t pos = 0;
+    while (pos < pattern.size()) {
+        size_t open = pattern.find('{', pos);
+        size_t close = open == std::string::npos ? open : pattern.find('}', open);
+        if (close == std::string::npos) {
+            out.append(pattern, pos, std::string::npos);
+            break;
+        }
+        out.append(pattern, pos, open - pos);
+        std::string field = pattern.substr(open + 1, close - open - 1);
+        char number[16];
+        if (field == "alt") {
+            out += std::to_string(alt);
+        } else if (field == "index") {
+            out += std::to_string(index);
+        } else if (field == "addr") {
+            out += std::to_string(address);
+        } else if (field == "addr:x" || field == "addr:X") {
+            std::snprintf(number, sizeof(number), field == "addr:x" ? "%x" : "%X", address);
+            out += number;
+        } else if (field == "name") {
+            for (const char* c = name; *c; c++) {
+                bool bad = (unsigned char)*c < 0x20 || std::strchr("/\\:*?\"<>|", *c);
+                out += bad ? '_' : *c;
+            }
+        } else {
+            out.append(pattern, open, close - open + 1);
+        }
+        pos = close + 1;
+    }
+    return out;
+}
+
+} // namespace detail
+
 class DFUFile {
 public:
-    DFUFile(const char* filename) {
+    // For LoadMode::Arena the payloads are allocated from arena, or from the
+    // default memory resource. The resource must outlive every element.
+    DFUFile(const char* filename, LoadMode mode = LoadMode::Stream, std::pmr::memory_resource* arena = nullptr) {
+        m_valid = false;
+
+        if (mode == LoadMode::Arena) {
+            auto mapping = detail::MappedFile::Open(filename);
+            if (!mapping) {
+                // The file stays invalid
+                return;
+            }
+            detail::ViewBuf view(mapping);
+            std::istream dfuFile(&view);
+            Parse(dfuFile);
+            if (m_valid) {
+                MoveToArena(arena ? arena : std::pmr::get_default_resource());
+            }
+            return;
+        }
+
+        if (mode == LoadMode::Indexed) {
+            LoadIndexed(filename);
+            return;
+        }
+
+        if (mode == LoadMode::Mapped) {
+            auto mapping = detail::MappedFile::Open(filename);
+            if (!mapping) {
+                // The file stays invalid
+                return;
+            }
+            detail::ViewBuf view(mapping);
+            std::istream dfuFile(&view);
+            Parse(dfuFile);
+            return;
+        }
+
+        if (mode == LoadMode::Lazy) {
+            detail::LazyFileBuf lazy(filename);
+            if (!lazy.IsOpen()) {
+                // The file stays invalid
+                return;
+            }
+            std::istream dfuFile(&lazy);
+            Parse(dfuFile);
+            return;
+        }
+
         std::ifstream dfuFile(filename, std::ios_base::binary);
+
+        if (!dfuFile) {
+            // TODO: Throw an error
+            return;
+        }
+
+        Parse(dfuFile);
+        dfuFile.close();
+    };
+
+    // Parse from memory without copying, data must outlive the DFUFile
+    DFUFile(const void* data, size_t size) {
+        m_valid = false;
+        source::Memory memory(data, size);
+        std::istream in(&memory);
+        Parse(in);
+    }
+
+    // Parse from any byte source, see namespace source
+    explicit DFUFile(std::streambuf& source) {
+        m_valid = false;
+        std::istream in(&source);
+        Parse(in);
+    }
+
+    explicit DFUFile(std::istream& in) {
         m_valid = false;
+        Parse(in);
+    }
+
+    // Images and elements share their data, copies are cheap
+    DFUFile(const DFUFile&) = default;
+    DFUFile(DFUFile&&) noexcept = default;
+    DFUFile& operator=(const DFUFile&) = default;
+    DFUFile& operator=(DFUFile&&) noexcept = default;
+
+    // Serialize into a single buffer. Sizes and the CRC are recomputed from the
+    // current images and elements. Empty if a payload cannot be read.
+    std::vector<uint8_t> Serialize() {
+        std::vector<uint8_t> headers;
+        std::vector<ByteSpan> segments;
+        size_t total = Layout(headers, segments);
+
+        std::vector<uint8_t> out(total);
+        uint8_t* position = out.data();
+        for (const ByteSpan& segment : segments) {
+            if (!segment.empty()) {
+                std::memcpy(position, segment.data(), segment.size());
+                position += segment.size();
+            }
+        }
+        return out;
+    }
+
+    // Returns the number of bytes written, 0 on failure. Payloads are written
+    // straight from the element buffers. On failure the file may be left
+    // partially written.
+    uint32_t Write(std::string filename) {
+        sink::File out(filename);
+        if (!out.IsOpen()) {
+            return 0;
+        }
+        uint32_t written = Write(out);
+        if (!out.Close()) {
+            return 0;
+        }
+        return written;
+    }
+
+    // Returns the number of bytes written, 0 if a payload cannot be read or
+    // the sink failed. What the sink already took is not undone.
+    uint32_t Write(sink::Sink& out) {
+        std::vector<uint8_t> headers;
+        std::vector<ByteSpan> segments;
+        size_t total = Layout(headers, segments);
+        if (total == 0 || !out.Write(segments)) {
+            return 0;
+        }
+        return (uint32_t)total;
+    }
+
+    operator bool() const {return m_valid;}
+    bool operator!() const {return !m_valid;}
+
+    unsigned int FileFormatVersion() const { return m_prefix.Version; }
+    unsigned int Vendor() const { return m_suffix.Vendor; }
+    unsigned int Product() const { return m_suffix.Product; }
+    unsigned int DeviceVersion() const { return m_suffix.DeviceVersion; }
+    const std::vector<DFUImage>& Images() const { return m_images; }
+    uint32_t Crc() const { return m_suffix.Crc32; }
+    // Lazy loads do not read the payloads and leave the CRC unchecked
+    CrcCheck CrcStatus() const { return m_crcStatus; }
+    uint32_t ComputedCrc() const { return m_computedCrc; }
+
+    // SHA-256 of an element payload, taken from the sidecar for indexed loads
+    std::array<uint8_t, 32> ElementDigest(size_t imageIndex, size_t elementIndex) const {
+        size_t flat = elementIndex;
+        for (size_t i = 0; i < imageIndex; i++) {
+            flat += m_images[i].Elements().size();
+        }
+        if (flat < m_digests.size()) {
+            return m_digests[flat];
+        }
+        ByteSpan data = m_images[imageIndex].Elements()[elementIndex].Data();
+        detail::Sha256 sha;
+        sha.Update(data.data(), data.size());
+        return sha.Final();
+    }
+
+    // Write every element of every image to its own file named by pattern
+    // (see detail::ExpandPattern), e.g. "{alt}_{name}_{index}_{addr:x}.bin".
+    // Elements are written concurrently, largest first, on the shared pool.
+    // maxInFlight bounds the memory the writers hold at once (see
+    // FileWriter::BufferSize), an element larger than the bound is written on
+    // its own. Returns false if any element failed, the others are still
+    // written. Returns false without writing anything if the pattern names
+    // two elements alike.
+    bool Export(const std::string& pattern, writer::FileWriter& writer = writer::Bin,
+                uint64_t maxInFlight = 256 * 1024 * 1024) const {
+        struct Job {
+            const DFUImage* image;
+            size_t index;
+            uint64_t cost;
+            std::string filename;
+        };
+        std::vector<Job> jobs;
+        for (const DFUImage& image : m_images) {
+            for (size_t i = 0; i < image.Elements().size(); i++) {
+                const DFUTarget& target = image.Elements()[i];
+                jobs.push_back({ &image, i, writer.BufferSize(target),
+                                 detail::ExpandPattern(pattern, image.Id(), image.Name(), i, target.Address()) });
+            }
+        }
+        std::vector<const std::string*> names;
+        for (const Job& job : jobs) {
+            names.push_back(&job.filename);
+        }
+        std::sort(names.begin(), names.end(), [](const std::string* a, const std::string* b) { return *a < *b; });
+        if (std::adjacent_find(names.begin(), names.end(),
+                               [](const std::string* a, const std::string* b) { return *a == *b; }) != names.end()) {
+            return false;
+        }
+        std::stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) { return a.cost > b.cost; });
+
+        // Budget is taken here before a job is queued, never inside a pool
+        // task, so no worker ever blocks on it. While waiting the caller runs
+        // queued work itself.
+        detail::ThreadPool& pool = detail::ThreadPool::Shared();
+        std::mutex lock;
+        std::condition_variable released;
+        uint64_t inFlight = 0;
+        size_t pending = 0;
+        std::atomic<bool> ok(true);
+        auto waitUntil = [&](const std::function<bool()>& ready) {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!ready()) {
+                guard.unlock();
+                bool ran = pool.RunOne();
+                guard.lock();
+                if (!ran && !ready()) {
+                    released.wait_for(guard, std::chrono::milliseconds(1));
+                }
+            }
+        };
+        for (const Job& job : jobs) {
+            waitUntil([&] { return inFlight == 0 || inFlight + job.cost <= maxInFlight; });
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                inFlight += job.cost;
+                pending++;
+            }
+            pool.Submit([&, &job = job] {
+                if (!job.image->Write(job.filename, (int)job.index, writer)) {
+                    ok = false;
+                }
+                // Notify under the lock, Export may return as soon as it is released
+                std::lock_guard<std::mutex> guard(lock);
+                inFlight -= job.cost;
+                pending--;
+                released.notify_all();
+            });
+        }
+        waitUntil([&] { return pending == 0; });
+        return ok;
+    }
+
+private:
+    friend ProbeResult Probe(const char* filename);
+    friend std::vector<ProbeResult> ProbeFiles(const std::vector<std::string>& paths);
+    friend class StreamParser;
+    friend class DFUBuilder;
+
+    DFUFile() {};
+
+    // ProbeResult from the raw prefix and suffix bytes
+    static ProbeResult Decode(const uint8_t* prefixBytes, const uint8_t* suffixBytes) {
+        ProbeResult result;
+        Prefix prefix;
+        Suffix suffix;
+        detail::MemoryBuf prefixBuf(prefixBytes, Prefix::Length);
+        detail::MemoryBuf suffixBuf(suffixBytes, Suffix::Size);
+        std::istream prefixIn(&prefixBuf);
+        std::istream suffixIn(&suffixBuf);
+        prefixIn >> prefix;
+        suffixIn >> suffix;
+
+        if (!prefixIn || !suffixIn || std::memcmp(prefix.Signature, "DfuSe", 5) != 0
+            || std::memcmp(suffix.Ufd, "UFD", 3) != 0) {
+            return result;
+        }
+
+        result.FileFormatVersion = prefix.Version;
+        result.Targets = prefix.Targets;
+        result.Vendor = suffix.Vendor;
+        result.Product = suffix.Product;
+        result.DeviceVersion = suffix.DeviceVersion;
+        result.DfuFormat = suffix.DfuFormat;
+        result.Valid = true;
+        return result;
+    }
+
+    void Parse(std::istream& dfuFile) {
+        auto source = dynamic_cast<detail::StorageSource*>(dfuFile.rdbuf());
+        if (source) {
+            // Payloads are not copied, but CRCing them in place touches every
+            // page of a mapping, see LoadMode
+            if (!ParseImages(dfuFile)) {
+                return;
+            }
+            auto storage = source->GetStorage();
+            std::streamoff position = dfuFile.tellg();
+            if (storage->Contiguous() && position >= 0) {
+                ParseSuffix(dfuFile, crc::UpdateParallel(0xFFFFFFFF, storage->Contiguous(), position), true);
+            } else {
+                ParseSuffix(dfuFile, 0, false);
+            }
+            return;
+        }
+
+        detail::CrcBuf crcBuf(*dfuFile.rdbuf());
+        std::istream crcFile(&crcBuf);
+        if (ParseImages(crcFile)) {
+            ParseSuffix(crcFile, crcBuf.Checkpoint(), true);
+        }
+        dfuFile.setstate(crcFile.rdstate());
+    }
+
+    // Element sizes were checked against the file while parsing, so the
+    // block is sized from trusted values. Every payload starts on a cache line.
+    void MoveToArena(std::pmr::memory_resource* resource) {
+        auto aligned = [](size_t size) {
+            return (size + detail::Arena::Alignment - 1) & ~(detail::Arena::Alignment - 1);
+        };
+        size_t total = 0;
+        for (const DFUImage& image : m_images) {
+            for (const DFUTarget& target : image.Elements()) {
+                total += aligned(target.Data().size());
+            }
+        }
+        auto arena = std::make_shared<detail::Arena>(resource, total);
+        size_t offset = 0;
+        for (DFUImage& image : m_images) {
+            for (DFUTarget& target : image.Mutable().Targets) {
+                ByteSpan data = target.Data();
+                if (!data.empty()) {
+                    std::memcpy(arena->Data() + offset, data.data(), data.size());
+                }
+                target.m_storage = arena;
+                target.m_offset = offset;
+                offset += aligned(data.size());
+            }
+        }
+    }
+
+    bool ParseImages(std::istream& dfuFile) {
+        dfuFile >> m_prefix;
+
+        if (!dfuFile || std::memcmp(m_prefix.Signature,"DfuSe",5) != 0) {
+            // TODO: Throw an error
+            return false;
+        }
+        m_images.resize(m_prefix.Targets);
+
+        for (DFUImage& image : m_images) {
+            dfuFile >> image;
+            if (!dfuFile || !image) {
+                // TODO: Throw an error
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Refresh the size fields and CRC and build the scatter list of the file.
+    // Prefixes are encoded into headers, payloads are referenced in place.
+    // Nothing can change once laid out, so later calls reuse the CRC. The
+    // output CRC is kept apart, Crc() and CrcStatus() still describe the
+    // file as it was parsed. Returns 0, changing nothing, if a payload cannot
+    // be read.
+    size_t Layout(std::vector<uint8_t>& headers, std::vector<ByteSpan>& segments) {
+        segments.clear();
+        for (const DFUImage& image : m_images) {
+            for (const DFUTarget& target : image.Elements()) {
+                if (!target.IsReadable()) {
+                    return 0;
+                }
+            }
+        }
+        bool computeCrc = !m_layoutCurrent;
+        size_t headerSize = Prefix::Length + Suffix::Size;
+        size_t elementCount = 0;
+        for (DFUImage& image : m_images) {
+            uint32_t imageSize = 0;
+            for (const DFUTarget& target : image.Elements()) {
+                imageSize += DFUTarget::Prefix::Length + (uint32_t)target.Data().size();
+            }
+            // Parsed images already agree, only touch (and unshare) them if not
+            if (image.m_state->Header.Size != imageSize || image.m_state->Header.Elements != image.Elements().size()) {
+                image.Mutable().Header.Size = imageSize;
+                image.Mutable().Header.Elements = (uint32_t)image.Elements().size();
+            }
+            elementCount += image.Elements().size();
+            headerSize += DFUImage::Prefix::Length;
+        }
+        headerSize += elementCount * DFUTarget::Prefix::Length;
+
+        m_prefix.Size = Prefix::Length;
+        for (const DFUImage& image : m_images) {
+            m_prefix.Size += DFUImage::Prefix::Length + image.m_state->Header.Size;
+        }
+        m_prefix.Targets = (uint8_t)m_images.size();
+
+        // Sized up front so spans into it stay valid
+        headers.resize(headerSize);
+        segments.clear();
+        segments.reserve(2 * elementCount + 2);
+        uint8_t* position = headers.data();
+        uint8_t* runStart = position;
+        uint32_t crc = 0xFFFFFFFF;
+        auto flush = [&] {
+            if (position != runStart) {
+                if (computeCrc) {
+                    crc = crc::Update(crc, runStart, position - runStart);
+                }
+                segments.push_back(ByteSpan(runStart, position - runStart));
+                runStart = position;
+            }
+        };
+
+        m_prefix.Encode(position);
+        position += Prefix::Length;
+        for (const DFUImage& image : m_images) {
+            image.m_state->Header.Encode(position);
+            position += DFUImage::Prefix::Length;
+            for (const DFUTarget& target : image.Elements()) {
+                DFUTarget::Prefix prefix = target.m_prefix;
+                prefix.Size = (uint32_t)target.Data().size();
+                prefix.Encode(position);
+                position += DFUTarget::Prefix::Length;
+                flush();
+                ByteSpan payload = target.Data();
+                if (computeCrc) {
+                    crc = crc::Update(crc, payload.data(), payload.size());
+                }
+                segments.push_back(payload);
+            }
+        }
 
-        if (!dfuFile) {
-            // TODO: Throw an error
-            return;
+        // Prefixes after the last element, e.g. of images without elements
+        flush();
+        if (computeCrc) {
+            m_suffix.Encode(position);
+            m_layoutCrc = crc::Update(crc, position, 12);
+            m_layoutCurrent = true;
         }
+        Suffix suffix = m_suffix;
+        suffix.Crc32 = m_layoutCrc;
+        suffix.Encode(position);
+        position += Suffix::Size;
+        segments.push_back(ByteSpan(runStart, position - runStart));
 
-        dfuFile >> m_prefix;
+        return m_prefix.Size + Suffix::Size;
+    }
 
-        if (!dfuFile || std::memcmp(m_prefix.Signature,"DfuSe",5) != 0) {
-            // TODO: Throw an error
+    // crc covers everything before the suffix
+    void ParseSuffix(std::istream& dfuFile, uint32_t crc, bool checkCrc) {
+        uint8_t suffixBytes[16];
+        dfuFile.read((char*)suffixBytes, sizeof(suffixBytes));
+        detail::MemoryBuf suffixBuf(suffixBytes, sizeof(suffixBytes));
+        std::istream suffixIn(&suffixBuf);
+        suffixIn >> m_suffix;
+        if (!dfuFile || !suffixIn) {
+            // The file stays invalid
             return;
         }
-        m_images.resize(m_prefix.Targets);
 
-        for (DFUImage& image : m_images) {
-            dfuFile >> image;
-            if (!dfuFile || !image) {
-                // TODO: Throw an error
+        if (checkCrc) {
+            m_computedCrc = crc::Update(crc, suffixBytes, 12);
+            m_crcStatus = m_computedCrc == m_suffix.Crc32 ? CrcCheck::Passed : CrcCheck::Failed;
+            if (m_crcStatus == CrcCheck::Failed) {
+                // The file stays invalid, CrcStatus() reports the mismatch
                 return;
             }
         }
+        m_valid = true;
+    }
+
+    // Sidecar layout, integers little endian:
+    //   8s      magic       "DfuSeIdx"
+    //   I       version     1
+    //   QQQq    key         device, inode, size, mtime in ns of the DFU file
+    //   I       crc         verified CRC
+    //   11s     prefix      file prefix as in the file
+    //   16s     suffix      file suffix as in the file
+    //   per image:   274s image prefix
+    //     per element: 8s element prefix, Q file offset, 32s SHA-256
+    static constexpr char IndexMagic[9] = "DfuSeIdx";
+    static constexpr uint32_t IndexVersion = 1;
+
+    void LoadIndexed(const char* filename) {
+        auto mapping = detail::MappedFile::Open(filename);
+        if (!mapping) {
+            // The file stays invalid
+            return;
+        }
+#if !defined(_WIN32)
+        std::string indexName = std::string(filename) + ".dfuidx";
+        if (ReadIndex(indexName, mapping)) {
+            return;
+        }
+#endif
+        detail::ViewBuf view(mapping);
+        std::istream dfuFile(&view);
+        Parse(dfuFile);
+#if !defined(_WIN32)
+        if (m_valid && m_crcStatus == CrcCheck::Passed) {
+            // Best effort, a read-only directory just means no sidecar
+            WriteIndex(indexName, mapping->Key());
+        }
+#endif
+    }
+
+#if !defined(_WIN32)
+    bool ReadIndex(const std::string& indexName, const std::shared_ptr<detail::MappedFile>& mapping) {
+        std::ifstream indexFile(indexName, std::ios_base::binary);
+        std::vector<uint8_t> index((std::istreambuf_iterator<char>(indexFile)), std::istreambuf_iterator<char>());
+        detail::MemoryBuf buf(index.data(), index.size());
+        std::istream in(&buf);
+
+        char magic[8];
+        uint32_t version = 0;
+        detail::FileKey key;
+        uint32_t crc = 0;
+        in.read(magic, 8);
+        in.read((char*)&version, 4);
+        in.read((char*)&key.Device, 8);
+        in.read((char*)&key.Inode, 8);
+        in.read((char*)&key.Size, 8);
+        in.read((char*)&key.Modified, 8);
+        in.read((char*)&crc, 4);
+        if (!in || std::memcmp(magic, IndexMagic, 8) != 0 || version != IndexVersion || key != mapping->Key()) {
+            return false;
+        }
 
-        dfuFile >> m_suffix;
+        Prefix prefix;
+        Suffix suffix;
+        in >> prefix >> suffix;
+        if (!in || std::memcmp(prefix.Signature, "DfuSe", 5) != 0) {
+            return false;
+        }
+        std::vector<DFUImage> images(prefix.Targets);
+        std::vector<std::array<uint8_t, 32>> digests;
+        for (DFUImage& image : images) {
+            DFUImage::State& state = image.Mutable();
+            in >> state.Header;
+            if (!in || std::memcmp(state.Header.Signature, "Target", 6) != 0) {
+                return false;
+            }
+            for (uint32_t i = 0; i < state.Header.Elements; i++) {
+                DFUTarget::Prefix elementPrefix;
+                uint64_t offset = 0;
+                std::array<uint8_t, 32> digest;
+                in >> elementPrefix;
+                in.read((char*)&offset, 8);
+                in.read((char*)digest.data(), digest.size());
+                if (!in || offset > mapping->Size() || elementPrefix.Size > mapping->Size() - offset) {
+                    return false;
+                }
+                state.Targets.push_back(DFUTarget(elementPrefix.Address, mapping, offset, elementPrefix.Size));
+                digests.push_back(digest);
+            }
+            image.m_valid = true;
+        }
+        if (in.peek() != std::char_traits<char>::eof()) {
+            return false;
+        }
 
-        // TODO: Check CRC
+        m_prefix = prefix;
+        m_suffix = suffix;
+        m_images = std::move(images);
+        m_digests = std::move(digests);
+        m_computedCrc = crc;
+        m_crcStatus = CrcCheck::Passed;
         m_valid = true;
-        dfuFile.close();
-    };
+        return true;
+    }
 
-    //uint32_t Write(std::string filename) {
-    //    return 0;
-    //}
+    bool WriteIndex(const std::string& indexName, const detail::FileKey& key) {
+        std::vector<std::pair<size_t, const DFUTarget*>> elements;
+        for (const DFUImage& image : m_images) {
+            for (const DFUTarget& target : image.Elements()) {
+                elements.push_back(std::make_pair(elements.size(), &target));
+            }
+        }
+        std::vector<std::array<uint8_t, 32>> digests(elements.size());
+        if (!elements.empty()) {
+            detail::ThreadPool::Shared().ParallelFor(elements.size(), [&](size_t i) {
+                ByteSpan data = elements[i].second->Data();
+                detail::Sha256 sha;
+                sha.Update(data.data(), data.size());
+                digests[i] = sha.Final();
+            });
+        }
 
-    operator bool() const {return m_valid;}
-    bool operator!() const {return !m_valid;}
+        std::vector<uint8_t> out;
+        auto put = [&out](const void* data, size_t size) {
+            out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+        };
+        uint8_t header[DFUImage::Prefix::Length];
+        put(IndexMagic, 8);
+        put(&IndexVersion, 4);
+        put(&key.Device, 8);
+        put(&key.Inode, 8);
+        put(&key.Size, 8);
+        put(&key.Modified, 8);
+        put(&m_computedCrc, 4);
+        m_prefix.Encode(header);
+        put(header, Prefix::Length);
+        m_suffix.Encode(header);
+        put(header, Suffix::Size);
+        size_t flat = 0;
+        for (const DFUImage& image : m_images) {
+            image.m_state->Header.Encode(header);
+            put(header, DFUImage::Prefix::Length);
+            for (const DFUTarget& target : image.Elements()) {
+                target.m_prefix.Encode(header);
+                put(header, DFUTarget::Prefix::Length);
+                put(&target.m_offset, 8);
+                put(digests[flat].data(), 32);
+                flat++;
+            }
+        }
 
-    unsigned int FileFormatVersion() { return m_prefix.Version; }
-    unsigned int Vendor() { return m_suffix.Vendor; }
-    unsigned int Product() { return m_suffix.Product; }
-    unsigned int DeviceVersion() { return m_suffix.DeviceVersion; }
-    const std::vector<DFUImage>& Images() const { return m_images; }
-    uint32_t Crc() { return m_suffix.Crc32; }
+        // Replace atomically so readers never see a partial sidecar
+        std::string temporary = indexName + ".tmp";
+        sink::File file(temporary);
+        bool ok = file.IsOpen() && file.Write(out.data(), out.size());
+        ok = file.Close() && ok && ::rename(temporary.c_str(), indexName.c_str()) == 0;
+        if (!ok) {
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        m_digests = std::move(digests);
+        return true;
+    }
+#endif
 
-private:
-    DFUFile() {};
     bool m_valid;
+    CrcCheck m_crcStatus = CrcCheck::NotChecked;
+    uint32_t m_computedCrc = 0;
+    bool m_layoutCurrent = false;
+    uint32_t m_layoutCrc = 0;
+    std::vector<std::array<uint8_t, 32>> m_digests;
 
     struct Prefix {
+        static constexpr size_t Length = 11;
+
         uint8_t Signature[5];
         uint8_t Version;
         uint32_t Size;
         uint8_t Targets;
 
+        void Encode(uint8_t* out) const {
+            std::memcpy(out, Signature, 5);
+            out[5] = Version;
+            std::memcpy(out + 6, &Size, 4);
+            out[10] = Targets;
+        }
+
         //   <   little endian
         //   5s  char[5]     signature   "DfuSe"
         //   B   uint8_t     version     1
@@ -239,6 +3801,8 @@ private:
     std::vector<DFUImage> m_images;
 
     struct Suffix {
+        static constexpr size_t Size = 16;
+
         uint16_t DeviceVersion;
         uint16_t Product;
         uint16_t Vendor;
@@ -247,6 +3811,16 @@ private:
         uint8_t Length;
         uint32_t Crc32;
 
+        void Encode(uint8_t* out) const {
+            std::memcpy(out, &DeviceVersion, 2);
+            std::memcpy(out + 2, &Product, 2);
+            std::memcpy(out + 4, &Vendor, 2);
+            std::memcpy(out + 6, &DfuFormat, 2);
+            std::memcpy(out + 8, Ufd, 3);
+            out[11] = Length;
+            std::memcpy(out + 12, &Crc32, 4);
+        }
+
         //   <   little endian
         //   H   uint16_t    device  Firmware version
         //   H   uint16_t    product
@@ -269,4 +3843,858 @@ private:
     Suffix m_suffix;
 };
 
+// Read only the DfuSe prefix and the DFU suffix of a file without touching
+// any of the images.
+inline ProbeResult Probe(const char* filename) {
+    uint8_t prefixBytes[DFUFile::Prefix::Length];
+    uint8_t suffixBytes[DFUFile::Suffix::Size];
+
+#if defined(_WIN32)
+    std::ifstream file(filename, std::ios_base::binary);
+    file.read((char*)prefixBytes, sizeof(prefixBytes));
+    file.seekg(-(std::streamoff)sizeof(suffixBytes), std::ios_base::end);
+    file.read((char*)suffixBytes, sizeof(suffixBytes));
+    if (!file) {
+        return ProbeResult();
+    }
+#else
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return ProbeResult();
+    }
+    struct stat st;
+    bool ok = ::fstat(fd, &st) == 0 && st.st_size >= (off_t)(sizeof(prefixBytes) + sizeof(suffixBytes))
+        && ::pread(fd, prefixBytes, sizeof(prefixBytes), 0) == (ssize_t)sizeof(prefixBytes)
+        && ::pread(fd, suffixBytes, sizeof(suffixBytes), st.st_size - sizeof(suffixBytes)) == (ssize_t)sizeof(suffixBytes);
+    ::close(fd);
+    if (!ok) {
+        return ProbeResult();
+    }
+#endif
+    return DFUFile::Decode(prefixBytes, suffixBytes);
+}
+
+// Probe many files. On Linux the opens and reads of up to 256 files at a
+// time go through io_uring, so a batch costs a few syscalls instead of four
+// per file. Elsewhere, or when io_uring is not permitted, the files are
+// probed with pread on the shared pool.
+inline std::vector<ProbeResult> ProbeFiles(const std::vector<std::string>& paths) {
+    std::vector<ProbeResult> results(paths.size());
+    size_t first = 0;
+#if defined(DFUSE_IO_URING)
+    detail::BatchReader reader;
+    std::vector<detail::BatchFile> files;
+    while (reader.IsOpen() && first < paths.size()) {
+        size_t count = paths.size() - first < reader.MaxFiles ? paths.size() - first : reader.MaxFiles;
+        if (!reader.Read(paths, first, count, false, files)) {
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (files[i].Error == 0 && files[i].Size >= DFUFile::Prefix::Length + DFUFile::Suffix::Size) {
+                results[first + i] = DFUFile::Decode(files[i].Head, files[i].Tail);
+            }
+        }
+        first += count;
+    }
+#endif
+    if (first < paths.size()) {
+        detail::ThreadPool::Shared().ParallelFor(paths.size() - first, [&](size_t i) {
+            results[first + i] = Probe(paths[first + i].c_str());
+        });
+    }
+    return results;
+}
+
+// Metadata of one file found by ScanFiles / ScanDirectory
+struct CatalogEntry {
+    struct Element {
+        uint32_t Address = 0;
+        uint32_t Size = 0;
+    };
+    struct Target {
+        int AltSetting = 0;
+        std::string Name;
+        std::vector<Element> Elements;
+    };
+
+    std::string Path;
+    bool Valid = false;
+    unsigned int FileFormatVersion = 0;
+    unsigned int Vendor = 0;
+    unsigned int Product = 0;
+    unsigned int DeviceVersion = 0;
+    uint32_t Crc = 0;
+    CrcCheck CrcStatus = CrcCheck::NotChecked;
+    std::vector<Target> Targets;
+
+    operator bool() const {return Valid;}
+    bool operator!() const {return !Valid;}
+};
+
+// Runs fn(i) for every i in [0, count) and returns once all calls finished.
+// Lets callers scan on their own threads instead of the shared pool.
+using Executor = std::function<void(size_t count, const std::function<void(size_t)>& fn)>;
+
+namespace detail {
+
+inline void Catalog(const DFUFile& file, CatalogEntry& entry) {
+    entry.CrcStatus = file.CrcStatus();
+    if (!file) {
+        return;
+    }
+    entry.FileFormatVersion = file.FileFormatVersion();
+    entry.Vendor = file.Vendor();
+    entry.Product = file.Product();
+    entry.DeviceVersion = file.DeviceVersion();
+    entry.Crc = file.Crc();
+    for (const DFUImage& image : file.Images()) {
+        CatalogEntry::Target target;
+        target.AltSetting = image.Id();
+        target.Name = image.Name();
+        for (const DFUTarget& element : image.Elements()) {
+            target.Elements.push_back({ element.Address(), (uint32_t)element.Size() });
+        }
+        entry.Targets.push_back(std::move(target));
+    }
+    entry.Valid = true;
+}
+
+} // namespace detail
+
+// Parse every file concurrently and return one entry per path, in order.
+// On Linux small files are read through io_uring, at most 64 files and
+// 64 MB per batch, and parsed from memory. Larger files, and every file
+// elsewhere, are mapped. Either way the CRC is checked.
+inline std::vector<CatalogEntry> ScanFiles(const std::vector<std::string>& paths, const Executor& executor = Executor()) {
+    std::vector<CatalogEntry> catalog(paths.size());
+    auto run = [&](size_t count, const std::function<void(size_t)>& fn) {
+        if (executor) {
+            executor(count, fn);
+        } else if (count > 0) {
+            detail::ThreadPool::Shared().ParallelFor(count, fn);
+        }
+    };
+    // A file that cannot be parsed for any reason is recorded as invalid
+    // instead of ending the scan
+    auto scan = [&](size_t i, const std::function<void(CatalogEntry&)>& parse) {
+        CatalogEntry& entry = catalog[i];
+        entry.Path = paths[i];
+        try {
+            parse(entry);
+        } catch (...) {
+            entry = CatalogEntry();
+            entry.Path = paths[i];
+        }
+    };
+    auto scanMapped = [&](size_t i) {
+        scan(i, [&](CatalogEntry& entry) {
+            DFUFile file(entry.Path.c_str(), LoadMode::Mapped);
+            detail::Catalog(file, entry);
+        });
+    };
+    std::vector<size_t> mapped;
+    size_t first = 0;
+#if defined(DFUSE_IO_URING)
+    const size_t batch = 64;
+    const uint64_t batchBytes = 64 * 1024 * 1024;
+    detail::BatchReader reader;
+    std::vector<detail::BatchFile> files;
+    while (reader.IsOpen() && first < paths.size()) {
+        size_t count = paths.size() - first < batch ? paths.size() - first : batch;
+        if (!reader.Read(paths, first, count, true, files, batchBytes)) {
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (files[i].Deferred) {
+                mapped.push_back(first + i);
+            }
+        }
+        run(count, [&](size_t i) {
+            scan(first + i, [&](CatalogEntry& entry) {
+                if (files[i].Error == 0 && !files[i].Deferred) {
+                    DFUFile file(files[i].Data.data(), files[i].Data.size());
+                    detail::Catalog(file, entry);
+                }
+            });
+        });
+        first += count;
+    }
+#endif
+    for (size_t i = first; i < paths.size(); i++) {
+        mapped.push_back(i);
+    }
+    run(mapped.size(), [&](size_t i) { scanMapped(mapped[i]); });
+    return catalog;
+}
+
+// ScanFiles over every *.dfu file below directory, sorted by path.
+// Unreadable directories are skipped.
+inline std::vector<CatalogEntry> ScanDirectory(const std::string& directory, bool recursive = true,
+                                               const Executor& executor = Executor()) {
+    namespace fs = std::filesystem;
+    std::vector<std::string> paths;
+    std::error_code error;
+    auto consider = [&](const fs::directory_entry& entry) {
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)std::tolower((unsigned char)c); });
+        std::error_code statError;
+        if (extension == ".dfu" && entry.is_regular_file(statError)) {
+            paths.push_back(entry.path().string());
+        }
+    };
+    if (recursive) {
+        fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, error), end;
+        for (; !error && it != end; it.increment(error)) {
+            consider(*it);
+        }
+    } else {
+        fs::directory_iterator it(directory, fs::directory_options::skip_permission_denied, error), end;
+        for (; !error && it != end; it.increment(error)) {
+            consider(*it);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return ScanFiles(paths, executor);
+}
+
+// Answers "newest firmware for VID:PID up to release bcdDevice" over a
+// firmware repository. The index is one flat buffer, integers little endian,
+// that is used in place, so a service maps the file and serves queries at
+// once:
+//   8s      magic       "DfuSeRes"
+//   I       version     1
+//   I       count       number of entries
+//   I       strings     offset of the path table
+//   I       size        size of the path table
+//   count * Entry       sorted by vendor, product, device version
+//   paths               NUL terminated, referenced by Entry::Path
+// As in the DFU suffix 0xFFFF in vendor, product or device version means any.
+class FirmwareIndex {
+public:
+    struct Entry {
+        uint16_t Vendor;
+        uint16_t Product;
+        uint16_t DeviceVersion;
+        uint16_t Targets;
+        uint32_t Path;
+        uint32_t Crc;
+    };
+
+    FirmwareIndex() = default;
+
+    // Map an index written by Save. The index is invalid if the file is
+    // missing, truncated or of another version.
+    explicit FirmwareIndex(const char* filename) {
+        auto mapping = detail::MappedFile::Open(filename);
+        if (mapping && Attach(mapping->Data(), mapping->Size())) {
+            m_mapping = mapping;
+        }
+    }
+
+    // Use an index built by Encode, takes ownership of the bytes
+    explicit FirmwareIndex(std::vector<uint8_t> bytes) : m_bytes(std::move(bytes)) {
+        if (!Attach(m_bytes.data(), m_bytes.size())) {
+            m_bytes.clear();
+        }
+    }
+
+    // Entries point into the bytes, copies and moves attach to their own
+    FirmwareIndex(const FirmwareIndex& other) { *this = other; }
+    FirmwareIndex(FirmwareIndex&& other) noexcept { *this = std::move(other); }
+    FirmwareIndex& operator=(const FirmwareIndex& other) {
+        if (this != &other) {
+            m_mapping = other.m_mapping;
+            m_bytes = other.m_bytes;
+            Reattach(other);
+        }
+        return *this;
+    }
+    FirmwareIndex& operator=(FirmwareIndex&& other) noexcept {
+        if (this != &other) {
+            m_mapping = std::move(other.m_mapping);
+            m_bytes = std::move(other.m_bytes);
+            Reattach(other);
+            other.m_bytes.clear();
+            other.Detach();
+        }
+        return *this;
+    }
+
+    // Build the flat index over the valid entries of a scan
+    static std::vector<uint8_t> Encode(const std::vector<CatalogEntry>& catalog) {
+        std::vector<const CatalogEntry*> sorted;
+        for (const CatalogEntry& entry : catalog) {
+            if (entry) {
+                sorted.push_back(&entry);
+            }
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [](const CatalogEntry* a, const CatalogEntry* b) {
+            return std::make_tuple(a->Vendor, a->Product, a->DeviceVersion) < std::make_tuple(b->Vendor, b->Product, b->DeviceVersion);
+        });
+
+        uint32_t count = (uint32_t)sorted.size();
+        uint32_t strings = (uint32_t)(HeaderSize + count * sizeof(Entry));
+        std::vector<uint8_t> out(strings);
+        std::vector<Entry> entries(count);
+        for (uint32_t i = 0; i < count; i++) {
+            entries[i] = { (uint16_t)sorted[i]->Vendor, (uint16_t)sorted[i]->Product, (uint16_t)sorted[i]->DeviceVersion,
+                           (uint16_t)sorted[i]->Targets.size(), (uint32_t)(out.size() - strings), sorted[i]->Crc };
+            out.insert(out.end(), sorted[i]->Path.begin(), sorted[i]->Path.end());
+            out.push_back(0);
+        }
+        uint32_t version = Version;
+        uint32_t stringsSize = (uint32_t)(out.size() - strings);
+        std::memcpy(out.data(), Magic, 8);
+        std::memcpy(out.data() + 8, &version, 4);
+        std::memcpy(out.data() + 12, &count, 4);
+        std::memcpy(out.data() + 16, &strings, 4);
+        std::memcpy(out.data() + 20, &stringsSize, 4);
+        if (count > 0) {
+            std::memcpy(out.data() + HeaderSize, entries.data(), count * sizeof(Entry));
+        }
+        return out;
+    }
+
+    // False for an invalid index, nothing is written
+    bool Save(const std::string& filename) const {
+        if (!*this) {
+            return false;
+        }
+        sink::File file(filename);
+        bool ok = file.IsOpen() && file.Write(m_data, m_size);
+        return file.Close() && ok;
+    }
+
+    operator bool() const {return m_entries != nullptr;}
+    bool operator!() const {return m_entries == nullptr;}
+
+    size_t Size() const { return m_count; }
+    const Entry* begin() const { return m_entries; }
+    const Entry* end() const { return m_entries + m_count; }
+    const char* Path(const Entry& entry) const { return m_strings + entry.Path; }
+
+    // Newest firmware for vendor:product with a release at or below
+    // deviceVersion, nullptr if there is none. Exact vendor and product win
+    // over wildcards at the same release, firmware for any release is only
+    // returned when no versioned one applies.
+    const Entry* Resolve(uint16_t vendor, uint16_t product, uint16_t deviceVersion = 0xFFFF) const {
+        const Entry* best = nullptr;
+        const uint16_t vendors[2] = { vendor, 0xFFFF };
+        const uint16_t products[2] = { product, 0xFFFF };
+        uint16_t limit = deviceVersion < 0xFFFF ? deviceVersion : 0xFFFE;
+        for (int v = 0; v < (vendor == 0xFFFF ? 1 : 2); v++) {
+            for (int p = 0; p < (product == 0xFFFF ? 1 : 2); p++) {
+                const Entry* found = Below(vendors[v], products[p], limit);
+                if (found && (!best || found->DeviceVersion > best->DeviceVersion)) {
+                    best = found;
+                }
+            }
+        }
+        for (int v = 0; !best && v < 2; v++) {
+            for (int p = 0; !best && p < 2; p++) {
+                const Entry* found = Below(vendors[v], products[p], 0xFFFF);
+                best = found && found->DeviceVersion == 0xFFFF ? found : nullptr;
+            }
+        }
+        return best;
+    }
+
+private:
+    static constexpr char Magic[9] = "DfuSeRes";
+    static constexpr uint32_t Version = 1;
+    static constexpr size_t HeaderSize = 24;
+
+    // Last entry for vendor:product with DeviceVersion <= limit
+    const Entry* Below(uint16_t vendor, uint16_t product, uint16_t limit) const {
+        auto key = [](const Entry& entry) {
+            return (uint64_t)entry.Vendor << 32 | (uint64_t)entry.Product << 16 | entry.DeviceVersion;
+        };
+        uint64_t wanted = (uint64_t)vendor << 32 | (uint64_t)product << 16 | limit;
+        const Entry* after = std::upper_bound(begin(), end(), wanted,
+                                              [&](uint64_t value, const Entry& entry) { return value < key(entry); });
+        if (after == begin()) {
+            return nullptr;
+        }
+        const Entry* found = after - 1;
+        return found->Vendor == vendor && found->Product == product ? found : nullptr;
+    }
+
+    void Detach() {
+        m_data = nullptr;
+        m_size = 0;
+        m_entries = nullptr;
+        m_count = 0;
+        m_strings = nullptr;
+    }
+
+    // Attach to this object's copy of the bytes of a valid other
+    void Reattach(const FirmwareIndex& other) {
+        bool valid = (bool)other;
+        Detach();
+        if (valid) {
+            if (m_mapping) {
+                Attach(m_mapping->Data(), m_mapping->Size());
+            } else {
+                Attach(m_bytes.data(), m_bytes.size());
+            }
+        }
+    }
+
+    // Validates the header and every entry, false leaves the index invalid
+    bool Attach(const uint8_t* data, size_t size) {
+        uint32_t version, count, strings, stringsSize;
+        if (size < HeaderSize || std::memcmp(data, Magic, 8) != 0) {
+            return false;
+        }
+        std::memcpy(&version, data + 8, 4);
+        std::memcpy(&count, data + 12, 4);
+        std::memcpy(&strings, data + 16, 4);
+        std::memcpy(&stringsSize, data + 20, 4);
+        if (version != Version || strings != HeaderSize + (uint64_t)count * sizeof(Entry)
+            || (uint64_t)strings + stringsSize > size || (stringsSize > 0 && data[strings + stringsSize - 1] != 0)) {
+            return false;
+        }
+        // Entries are read in place, the buffer is at least 8 byte aligned
+        const Entry* entries = (const Entry*)(data + HeaderSize);
+        for (uint32_t i = 0; i < count; i++) {
+            if (entries[i].Path >= stringsSize) {
+                return false;
+            }
+        }
+        m_data = data;
+        m_size = size;
+        m_count = count;
+        m_strings = (const char*)data + strings;
+        m_entries = entries;
+        return true;
+    }
+
+    std::shared_ptr<detail::MappedFile> m_mapping;
+    std::vector<uint8_t> m_bytes;
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    const Entry* m_entries = nullptr;
+    size_t m_count = 0;
+    const char* m_strings = nullptr;
+};
+
+// Parsed files shared between threads. Get hands out immutable snapshots
+// keyed by path and file identity, a file that changed on disk is parsed
+// again. Concurrent first requests for a path wait for a single parse.
+// Least recently used files are dropped once the file sizes add up to more
+// than the capacity, snapshots still held by callers stay valid.
+class FileCache {
+public:
+    explicit FileCache(uint64_t capacity = 1024ull * 1024 * 1024) : m_capacity(capacity) {}
+
+    static FileCache& Shared() {
+        static FileCache cache;
+        return cache;
+    }
+
+    // nullptr if the file cannot be opened or is not a valid DfuSe file. An
+    // exception from the parse, e.g. std::bad_alloc, reaches every caller
+    // waiting on it and is not cached.
+    std::shared_ptr<const DFUFile> Get(const std::string& path, LoadMode mode = LoadMode::Mapped) {
+#if defined(_WIN32)
+        auto file = std::make_shared<const DFUFile>(path.c_str(), mode);
+        return *file ? file : nullptr;
+#else
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) {
+            return nullptr;
+        }
+        detail::FileKey key = detail::FileKey::Of(st);
+
+        std::promise<std::shared_ptr<const DFUFile>> parsed;
+        std::shared_future<std::shared_ptr<const DFUFile>> result;
+        uint64_t generation = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            auto found = m_entries.find(path);
+            if (found != m_entries.end() && found->second.Key == key && found->second.Mode == mode) {
+                m_recent.splice(m_recent.begin(), m_recent, found->second.Recent);
+                result = found->second.File;
+            } else {
+                if (found != m_entries.end()) {
+                    Drop(found);
+                }
+                result = parsed.get_future().share();
+                generation = ++m_generation;
+                m_recent.push_front(path);
+                m_entries[path] = { key, mode, result, m_recent.begin(), generation };
+            }
+        }
+        if (generation == 0) {
+            // Cached or being parsed by another caller, wait without the lock
+            return result.get();
+        }
+
+        std::shared_ptr<const DFUFile> file;
+        try {
+            file = std::make_shared<const DFUFile>(path.c_str(), mode);
+        } catch (...) {
+            // Waiters see the same exception, the next Get tries again
+            parsed.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(m_lock);
+            auto found = m_entries.find(path);
+            if (found != m_entries.end() && found->second.Generation == generation) {
+                Drop(found);
+            }
+            throw;
+        }
+        if (!*file) {
+            file.reset();
+        }
+        parsed.set_value(file);
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto found = m_entries.find(path);
+        if (found != m_entries.end() && found->second.Generation == generation) {
+            if (!file) {
+                // Do not hold on to failures, the next Get tries again
+                Drop(found);
+            } else {
+                found->second.Size = key.Size;
+                m_size += key.Size;
+                Evict();
+            }
+        }
+        return file;
+#endif
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(m_lock);
+#if !defined(_WIN32)
+        m_entries.clear();
+#endif
+        m_recent.clear();
+        m_size = 0;
+    }
+
+    size_t Count() const {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_recent.size();
+    }
+
+private:
+#if !defined(_WIN32)
+    struct Entry {
+        detail::FileKey Key;
+        LoadMode Mode;
+        std::shared_future<std::shared_ptr<const DFUFile>> File;
+        std::list<std::string>::iterator Recent;
+        uint64_t Generation;   // tells a re-inserted entry for the path apart
+        uint64_t Size = 0;     // counted once parsed
+    };
+
+    void Drop(std::map<std::string, Entry>::iterator entry) {
+        m_size -= entry->second.Size;
+        m_recent.erase(entry->second.Recent);
+        m_entries.erase(entry);
+    }
+
+    void Evict() {
+        // The most recent file always stays, even if it alone is too large
+        while (m_size > m_capacity && m_recent.size() > 1) {
+            Drop(m_entries.find(m_recent.back()));
+        }
+    }
+
+    std::map<std::string, Entry> m_entries;
+    uint64_t m_generation = 0;
+#endif
+    mutable std::mutex m_lock;
+    std::list<std::string> m_recent;
+    uint64_t m_capacity;
+    uint64_t m_size = 0;
+};
+
+// Assembles a DfuSe file from payloads at known addresses. Payloads are
+// referenced, not copied: spans must outlive the built DFUFile and files are
+// mapped read-only.
+class DFUBuilder {
+public:
+    DFUBuilder(uint16_t vendor, uint16_t product, uint16_t deviceVersion = 0xFFFF)
+        : m_vendor(vendor), m_product(product), m_deviceVersion(deviceVersion) {}
+
+    // Elements with the same alt setting go into the same image, the name of
+    // the first one names the image
+    DFUBuilder& Add(uint8_t altSetting, const std::string& name, uint32_t address, ByteSpan payload) {
+        auto storage = std::make_shared<detail::MemoryView>(payload.data(), payload.size());
+        AddElement(altSetting, name, DFUTarget(address, storage, 0, (uint32_t)payload.size()));
+        return *this;
+    }
+
+    // Add an element from an importer, its payload is shared not copied
+    DFUBuilder& Add(uint8_t altSetting, const std::string& name, const DFUTarget& element) {
+        AddElement(altSetting, name, DFUTarget(element));
+        return *this;
+    }
+
+    // Every loadable segment of an ELF file, see reader::ReadElf. A file
+    // which cannot be read makes Build() return an invalid DFUFile.
+    DFUBuilder& AddElf(uint8_t altSetting, const std::string& name, const char* filename) {
+        std::vector<DFUTarget> elements;
+        if (!reader::ReadElf(filename, elements)) {
+            m_valid = false;
+            return *this;
+        }
+        for (DFUTarget& element : elements) {
+            AddElement(altSetting, name, std::move(element));
+        }
+        return *this;
+    }
+
+    // A file which cannot be mapped makes Build() return an invalid DFUFile
+    DFUBuilder& Add(uint8_t altSetting, const std::string& name, uint32_t address, const char* filename) {
+        auto mapping = detail::MappedFile::Open(filename);
+        if (!mapping) {
+            m_valid = false;
+            return *this;
+        }
+        AddElement(altSetting, name, DFUTarget(address, mapping, 0, (uint32_t)mapping->Size()));
+        return *this;
+    }
+
+    // Fills in every size field and the suffix CRC in a single pass over the payloads
+    DFUFile Build() const {
+        DFUFile file;
+        file.m_valid = false;
+        if (!m_valid || m_images.size() > 255) {
+            return file;
+        }
+
+        std::memcpy(file.m_prefix.Signature, "DfuSe", 5);
+        file.m_prefix.Version = 1;
+        file.m_images = m_images;
+        for (DFUImage& image : file.m_images) {
+            image.m_valid = true;
+        }
+
+        file.m_suffix.DeviceVersion = m_deviceVersion;
+        file.m_suffix.Product = m_product;
+        file.m_suffix.Vendor = m_vendor;
+        file.m_suffix.DfuFormat = 0x011A;
+        std::memcpy(file.m_suffix.Ufd, "UFD", 3);
+        file.m_suffix.Length = DFUFile::Suffix::Size;
+
+        std::vector<uint8_t> headers;
+        std::vector<ByteSpan> segments;
+        if (file.Layout(headers, segments) == 0) {
+            return file;
+        }
+        file.m_suffix.Crc32 = file.m_layoutCrc;
+        file.m_computedCrc = file.m_layoutCrc;
+        file.m_crcStatus = CrcCheck::Passed;
+        file.m_valid = true;
+        return file;
+    }
+
+private:
+    void AddElement(uint8_t altSetting, const std::string& name, DFUTarget&& target) {
+        for (DFUImage& image : m_images) {
+            if (image.Id() == altSetting) {
+                image.Mutable().Targets.push_back(std::move(target));
+                return;
+            }
+        }
+
+        DFUImage image;
+        DFUImage::State& state = image.Mutable();
+        std::memcpy(state.Header.Signature, "Target", 6);
+        state.Header.AltSetting = altSetting;
+        state.Header.IsNamed = name.empty() ? 0 : 1;
+        std::strncpy(state.Header.Name, name.c_str(), sizeof(state.Header.Name) - 1);
+        state.Targets.push_back(std::move(target));
+        m_images.push_back(std::move(image));
+    }
+
+    uint16_t m_vendor;
+    uint16_t m_product;
+    uint16_t m_deviceVersion;
+    std::vector<DFUImage> m_images;
+    bool m_valid = true;
+};
+
+// Callbacks from StreamParser, override the ones of interest
+class ParserEvents {
+public:
+    virtual ~ParserEvents() {}
+    virtual void OnFilePrefix(unsigned int /*version*/, uint32_t /*size*/, unsigned int /*targets*/) {}
+    virtual void OnImagePrefix(int /*id*/, const char* /*name*/, uint32_t /*size*/, uint32_t /*elements*/) {}
+    virtual void OnElementPrefix(uint32_t /*address*/, uint32_t /*size*/) {}
+    // Called one or more times per element, offset is relative to the element start
+    virtual void OnElementData(uint32_t /*address*/, uint32_t /*offset*/, ByteSpan /*data*/) {}
+    virtual void OnSuffix(const ProbeResult& /*info*/) {}
+};
+
+// Resumable parser for input arriving in chunks of any size. Events are raised
+// as soon as each part of the file is complete, element payloads are passed
+// straight through from the fed buffers without being collected.
+class StreamParser {
+public:
+    StreamParser(ParserEvents& events) : m_events(events) {
+        Expect(State::FilePrefix, DFUFile::Prefix::Length);
+    }
+
+    // Returns false once the input is found to be invalid, including a CRC
+    // mismatch once the suffix arrives
+    bool Feed(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+
+        while (size > 0) {
+            if (m_state == State::Done || m_state == State::Error) {
+                // Trailing bytes after the suffix
+                m_state = State::Error;
+                return false;
+            }
+
+            if (m_state == State::ElementData) {
+                size_t count = size < m_remaining ? size : m_remaining;
+                m_crc = crc::Update(m_crc, bytes, count);
+                m_events.OnElementData(m_address, m_offset, ByteSpan(bytes, count));
+                bytes += count;
+                size -= count;
+                m_offset += count;
+                m_remaining -= count;
+                if (m_remaining == 0) {
+                    NextElement();
+                }
+                continue;
+            }
+
+            size_t count = m_need - m_have;
+            count = size < count ? size : count;
+            std::memcpy(m_header + m_have, bytes, count);
+            if (m_state != State::Suffix) {
+                m_crc = crc::Update(m_crc, bytes, count);
+            } else if (m_have < 12) {
+                // The CRC covers the suffix up to its Crc32 field
+                m_crc = crc::Update(m_crc, bytes, (m_have + count < 12 ? m_have + count : 12) - m_have);
+            }
+            bytes += count;
+            size -= count;
+            m_have += count;
+            if (m_have == m_need && !HeaderComplete()) {
+                m_state = State::Error;
+                return false;
+            }
+        }
+        return m_state != State::Error;
+    }
+
+    // True once the suffix has been parsed
+    bool Done() const { return m_state == State::Done; }
+    bool Failed() const { return m_state == State::Error; }
+
+private:
+    enum class State { FilePrefix, ImagePrefix, ElementPrefix, ElementData, Suffix, Done, Error };
+
+    template <typename T>
+    bool Decode(T& obj) {
+        detail::MemoryBuf buf(m_header, m_have);
+        std::istream in(&buf);
+        in >> obj;
+        return (bool)in;
+    }
+
+    void Expect(State state, size_t size) {
+        m_state = state;
+        m_need = size;
+        m_have = 0;
+    }
+
+    void NextImage() {
+        if (m_images == 0) {
+            Expect(State::Suffix, DFUFile::Suffix::Size);
+            return;
+        }
+        m_images--;
+        Expect(State::ImagePrefix, DFUImage::Prefix::Length);
+    }
+
+    void NextElement() {
+        if (m_elements == 0) {
+            NextImage();
+            return;
+        }
+        m_elements--;
+        Expect(State::ElementPrefix, DFUTarget::Prefix::Length);
+    }
+
+    bool HeaderComplete() {
+        switch (m_state) {
+        case State::FilePrefix: {
+            DFUFile::Prefix prefix;
+            if (!Decode(prefix) || std::memcmp(prefix.Signature, "DfuSe", 5) != 0) {
+                return false;
+            }
+            m_info.FileFormatVersion = prefix.Version;
+            m_info.Targets = prefix.Targets;
+            m_images = prefix.Targets;
+            m_events.OnFilePrefix(prefix.Version, prefix.Size, prefix.Targets);
+            NextImage();
+            return true;
+        }
+        case State::ImagePrefix: {
+            DFUImage::Prefix prefix;
+            if (!Decode(prefix) || std::memcmp(prefix.Signature, "Target", 6) != 0) {
+                return false;
+            }
+            m_elements = prefix.Elements;
+            m_events.OnImagePrefix(prefix.AltSetting, prefix.Name, prefix.Size, prefix.Elements);
+            NextElement();
+            return true;
+        }
+        case State::ElementPrefix: {
+            DFUTarget::Prefix prefix;
+            if (!Decode(prefix)) {
+                return false;
+            }
+            m_address = prefix.Address;
+            m_remaining = prefix.Size;
+            m_offset = 0;
+            m_events.OnElementPrefix(prefix.Address, prefix.Size);
+            if (m_remaining == 0) {
+                NextElement();
+            } else {
+                m_state = State::ElementData;
+            }
+            return true;
+        }
+        case State::Suffix: {
+            DFUFile::Suffix suffix;
+            if (!Decode(suffix) || std::memcmp(suffix.Ufd, "UFD", 3) != 0 || suffix.Crc32 != m_crc) {
+                return false;
+            }
+            m_info.Vendor = suffix.Vendor;
+            m_info.Product = suffix.Product;
+            m_info.DeviceVersion = suffix.DeviceVersion;
+            m_info.DfuFormat = suffix.DfuFormat;
+            m_info.Valid = true;
+            m_state = State::Done;
+            m_events.OnSuffix(m_info);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    ParserEvents& m_events;
+    State m_state;
+    uint8_t m_header[DFUImage::Prefix::Length];
+    size_t m_need = 0;
+    size_t m_have = 0;
+    unsigned int m_images = 0;
+    uint32_t m_elements = 0;
+    uint32_t m_address = 0;
+    uint32_t m_offset = 0;
+    uint32_t m_remaining = 0;
+    uint32_t m_crc = 0xFFFFFFFF;
+    ProbeResult m_info;
+};
+
 } // namespace dfusefile
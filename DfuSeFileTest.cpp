@@ -28,7 +28,86 @@
 
 #include "DfuSeFile.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <thread>
+
+static bool SameElements(const dfuse::DFUFile& a, const dfuse::DFUFile& b) {
+    if (!a || !b || a.Images().size() != b.Images().size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.Images().size(); i++) {
+        auto& lhs = a.Images()[i].Elements();
+        auto& rhs = b.Images()[i].Elements();
+        if (lhs.size() != rhs.size()) {
+            return false;
+        }
+        for (size_t j = 0; j < lhs.size(); j++) {
+            if (lhs[j].Data().size() != rhs[j].Data().size() ||
+                !std::equal(lhs[j].Data().begin(), lhs[j].Data().end(), rhs[j].Data().begin())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Little endian ELF32 with loadable segments at physical addresses which
+// differ from their virtual ones:
+//   0x08000000 +0x10 and 0x08000010 +0x20, adjacent in memory and in the file
+//   0x08001000 +0x10 and 0x08001010 +0x08, adjacent in memory only
+// plus a .bss style segment and a non-loadable one which are skipped.
+static std::vector<uint8_t> WriteElf(const char* filename) {
+    std::vector<uint8_t> elf(0x210);
+    for (size_t i = 0x100; i < elf.size(); i++) {
+        elf[i] = (uint8_t)(i * 7);
+    }
+    auto put32 = [&](size_t offset, uint32_t value) { std::memcpy(&elf[offset], &value, 4); };
+    auto put16 = [&](size_t offset, uint16_t value) { std::memcpy(&elf[offset], &value, 2); };
+    const uint8_t ident[] = { 0x7F, 'E', 'L', 'F', 1, 1, 1 };
+    std::memcpy(elf.data(), ident, sizeof(ident));
+    put16(16, 2);
+    put16(18, 40);
+    put32(28, 52);
+    put16(40, 52);
+    put16(42, 32);
+    put16(44, 6);
+    // p_type, p_offset, p_vaddr, p_paddr, p_filesz, p_memsz follows filesz
+    const uint32_t segments[6][5] = {
+        { 1, 0x110, 0x20000010, 0x08000010, 0x20 },
+        { 1, 0x100, 0x20000000, 0x08000000, 0x10 },
+        { 4, 0x100, 0, 0, 0x10 },
+        { 1, 0x200, 0x20001000, 0x08001000, 0x10 },
+        { 1, 0x180, 0x20001010, 0x08001010, 0x08 },
+        { 1, 0x1F0, 0x20002000, 0x08002000, 0x00 },
+    };
+    for (size_t i = 0; i < 6; i++) {
+        for (size_t j = 0; j < 5; j++) {
+            put32(52 + i * 32 + j * 4, segments[i][j]);
+        }
+        put32(52 + i * 32 + 20, segments[i][4]);
+    }
+    std::ofstream(filename, std::ios_base::binary).write((const char*)elf.data(), elf.size());
+    return elf;
+}
+
+// Reassembles element payloads from StreamParser events
+class CollectEvents : public dfuse::ParserEvents {
+public:
+    std::vector<std::vector<uint8_t>> elements;
+    virtual void OnElementPrefix(uint32_t, uint32_t size) override {
+        elements.emplace_back();
+        elements.back().reserve(size);
+    }
+    virtual void OnElementData(uint32_t, uint32_t, dfuse::ByteSpan data) override {
+        elements.back().insert(elements.back().end(), data.begin(), data.end());
+    }
+};
 
 int main() {
     dfuse::DFUFile myFile("TestDFU.dfu");
@@ -37,18 +116,457 @@ int main() {
         std::cout << "Vendor: 0x" << std::hex << myFile.Vendor() << " Product: 0x" << std::hex << myFile.Product() << " Device Version: 0x" << std::hex << myFile.DeviceVersion() << std::endl;
         std::cout << "Number of Targets: " << myFile.Images().size() << std::endl;
 
-        for (auto image : myFile.Images()) {
+        for (const auto& image : myFile.Images()) {
             if (image) {
                 std::cout << "\t Id: " << image.Id() << " Name: " << image.Name() << " Size: " << image.Size() 
                           << " consisting of " << image.Elements().size() << " element(s)." << std::endl;
-                for (auto element : image.Elements()) {
+                for (const auto& element : image.Elements()) {
                     std::cout << "\t\t Element Address: 0x" << std::hex << element.Address() << " Size: " << element.Size() << std::endl;
                 }
-                image.Write("OutputTest.bin", dfuse::writer::Bin);
             } else {
                 std::cout << "\t INVALID IMAGE!" << std::endl;
             }
         }
+
+        if (!myFile.Export("OutputTest_{alt}_{name}_{index}_{addr:x}.bin")) {
+            std::cout << "Export FAILED!" << std::endl;
+            return -1;
+        }
+
+        // A budget below any one element serialises the writes on the caller
+        if (!myFile.Export("OutputTest_{alt}_{index}.hex", dfuse::writer::Hex, 1)) {
+            std::cout << "Bounded export FAILED!" << std::endl;
+            return -1;
+        }
+        dfuse::DFUFile twoElements = dfuse::DFUBuilder(0x0483, 0xDF11)
+            .Add(0, "Dup", 0x08000000, myFile.Images()[0].Elements()[0].Data())
+            .Add(0, "Dup", 0x08010000, myFile.Images()[0].Elements()[0].Data())
+            .Build();
+        if (!twoElements || twoElements.Export("OutputTest_dup.bin", dfuse::writer::Hex)) {
+            std::cout << "Export name collision FAILED!" << std::endl;
+            return -1;
+        }
+
+        if (myFile.CrcStatus() != dfuse::CrcCheck::Passed) {
+            std::cout << "CRC check FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::DFUFile mappedFile("TestDFU.dfu", dfuse::LoadMode::Mapped);
+        if (!SameElements(myFile, mappedFile)) {
+            std::cout << "Mapped load FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::DFUFile lazyFile("TestDFU.dfu", dfuse::LoadMode::Lazy);
+        if (!SameElements(myFile, lazyFile)) {
+            std::cout << "Lazy load FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::ifstream raw("TestDFU.dfu", std::ios_base::binary);
+        std::vector<char> bytes((std::istreambuf_iterator<char>(raw)), std::istreambuf_iterator<char>());
+        dfuse::DFUFile memoryFile(bytes.data(), bytes.size());
+        if (!SameElements(myFile, memoryFile)) {
+            std::cout << "Memory load FAILED!" << std::endl;
+            return -1;
+        }
+
+        {
+            // A lazy load must not read payloads from a file that replaced it
+            std::ofstream("OutputTest.lazy", std::ios_base::binary).write(bytes.data(), bytes.size());
+            dfuse::DFUFile replaced("OutputTest.lazy", dfuse::LoadMode::Lazy);
+            std::ofstream("OutputTest.swap", std::ios_base::binary).write(bytes.data(), bytes.size());
+            std::rename("OutputTest.swap", "OutputTest.lazy");
+            if (!replaced || replaced.Images()[0].Elements()[0].IsReadable()) {
+                std::cout << "Lazy replaced file FAILED!" << std::endl;
+                return -1;
+            }
+            std::vector<uint8_t> unreadable;
+            dfuse::sink::Memory unreadableSink(unreadable);
+            if (!replaced.Serialize().empty() || replaced.Write(unreadableSink) != 0 || !unreadable.empty()
+                || replaced.Images()[0].Write("OutputTest.lazy.hex", 0, dfuse::writer::Hex)) {
+                std::cout << "Unreadable payload write FAILED!" << std::endl;
+                return -1;
+            }
+            std::remove("OutputTest.lazy.hex");
+            std::remove("OutputTest.lazy");
+        }
+
+        if (memoryFile.CrcStatus() != dfuse::CrcCheck::Passed) {
+            std::cout << "Memory CRC check FAILED!" << std::endl;
+            return -1;
+        }
+        bytes[bytes.size() / 2] ^= 0x01;
+        if (dfuse::DFUFile(bytes.data(), bytes.size())) {
+            std::cout << "Corrupted file PASSED!" << std::endl;
+            return -1;
+        }
+        bytes[bytes.size() / 2] ^= 0x01;
+
+        size_t position = 0;
+        dfuse::source::Callback chunks([&](void* buffer, size_t size) {
+            size_t count = std::min<size_t>(std::min<size_t>(size, 7), bytes.size() - position);
+            std::memcpy(buffer, bytes.data() + position, count);
+            position += count;
+            return count;
+        });
+        dfuse::DFUFile callbackFile(chunks);
+        if (!SameElements(myFile, callbackFile)) {
+            std::cout << "Callback load FAILED!" << std::endl;
+            return -1;
+        }
+
+        if (myFile.Serialize() != std::vector<uint8_t>(bytes.begin(), bytes.end())) {
+            std::cout << "Serialize round trip FAILED!" << std::endl;
+            return -1;
+        }
+        if (mappedFile.Write("RoundTrip.dfu") != bytes.size()) {
+            std::cout << "Write FAILED!" << std::endl;
+            return -1;
+        }
+        if (mappedFile.Write("OutputTest.missing/RoundTrip.dfu") != 0) {
+            std::cout << "Write error FAILED!" << std::endl;
+            return -1;
+        }
+        std::ifstream written("RoundTrip.dfu", std::ios_base::binary);
+        if (!std::equal(bytes.begin(), bytes.end(), std::istreambuf_iterator<char>(written))) {
+            std::cout << "Write round trip FAILED!" << std::endl;
+            return -1;
+        }
+
+        uint32_t lazyCrc = lazyFile.Crc();
+        lazyFile.Serialize();
+        if (lazyFile.CrcStatus() != dfuse::CrcCheck::NotChecked || lazyFile.Crc() != lazyCrc) {
+            std::cout << "Serialize changed the parsed CRC!" << std::endl;
+            return -1;
+        }
+
+        // Trailing image without elements, its prefix is covered by the CRC
+        std::vector<uint8_t> emptyTail(bytes.begin(), bytes.end() - 16);
+        uint8_t emptyImage[274] = { 'T', 'a', 'r', 'g', 'e', 't', 1 };
+        emptyTail.insert(emptyTail.end(), emptyImage, emptyImage + sizeof(emptyImage));
+        uint32_t emptyTailSize = (uint32_t)emptyTail.size();
+        std::memcpy(&emptyTail[6], &emptyTailSize, 4);
+        emptyTail[10]++;
+        emptyTail.insert(emptyTail.end(), bytes.end() - 16, bytes.end() - 4);
+        uint32_t emptyTailCrc = dfuse::crc::Compute(emptyTail.data(), emptyTail.size());
+        emptyTail.insert(emptyTail.end(), (uint8_t*)&emptyTailCrc, (uint8_t*)&emptyTailCrc + 4);
+        dfuse::DFUFile emptyTailFile(emptyTail.data(), emptyTail.size());
+        if (!emptyTailFile || emptyTailFile.Images().size() != 2 || emptyTailFile.Serialize() != emptyTail) {
+            std::cout << "Empty image round trip FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::ByteSpan payload = myFile.Images()[0].Elements()[0].Data();
+        dfuse::DFUFile built = dfuse::DFUBuilder(myFile.Vendor(), myFile.Product(), myFile.DeviceVersion())
+            .Add(0, "Built", 0x08000000, payload)
+            .Add(1, "Config", 0x1FFFC000, dfuse::ByteSpan(payload.data(), 16))
+            .Build();
+        std::vector<uint8_t> builtBytes = built.Serialize();
+        dfuse::DFUFile rebuilt(builtBytes.data(), builtBytes.size());
+        if (!rebuilt || rebuilt.Images().size() != 2 || rebuilt.Crc() != built.Crc()
+            || rebuilt.Images()[0].Elements()[0].Data().size() != payload.size()) {
+            std::cout << "Builder FAILED!" << std::endl;
+            return -1;
+        }
+
+        myFile.Images()[0].Write("OutputTest.hex", 0, dfuse::writer::Hex);
+        std::vector<dfuse::DFUTarget> hexElements;
+        if (!dfuse::reader::ReadHex("OutputTest.hex", hexElements) || hexElements.size() != 1
+            || hexElements[0].Address() != myFile.Images()[0].Elements()[0].Address()
+            || hexElements[0].Data().size() != payload.size()
+            || !std::equal(payload.begin(), payload.end(), hexElements[0].Data().begin())) {
+            std::cout << "Intel HEX round trip FAILED!" << std::endl;
+            return -1;
+        }
+
+        myFile.Images()[0].Write("OutputTest.srec", 0, dfuse::writer::SRec);
+        std::vector<dfuse::DFUTarget> srecElements;
+        if (!dfuse::reader::ReadSRec("OutputTest.srec", srecElements) || srecElements.size() != 1
+            || srecElements[0].Address() != myFile.Images()[0].Elements()[0].Address()
+            || srecElements[0].Data().size() != payload.size()
+            || !std::equal(payload.begin(), payload.end(), srecElements[0].Data().begin())) {
+            std::cout << "S-record round trip FAILED!" << std::endl;
+            return -1;
+        }
+
+        myFile.Images()[0].Write("OutputTest.uf2", 0, dfuse::writer::Uf2);
+        std::vector<dfuse::DFUTarget> uf2Elements;
+        if (!dfuse::reader::ReadUf2("OutputTest.uf2", uf2Elements) || uf2Elements.size() != 1
+            || uf2Elements[0].Address() != myFile.Images()[0].Elements()[0].Address()
+            || uf2Elements[0].Data().size() != payload.size()
+            || !std::equal(payload.begin(), payload.end(), uf2Elements[0].Data().begin())) {
+            std::cout << "UF2 round trip FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::DFUFile gapped = dfuse::DFUBuilder(myFile.Vendor(), myFile.Product())
+            .Add(0, "Gapped", 0x08000000, dfuse::ByteSpan(payload.data(), 16))
+            .Add(0, "Gapped", 0x08000020, dfuse::ByteSpan(payload.data(), 16))
+            .Build();
+        if (!gapped.Images()[0].WriteFlat("OutputTest.flat")) {
+            std::cout << "Flat write FAILED!" << std::endl;
+            return -1;
+        }
+        std::ifstream flat("OutputTest.flat", std::ios_base::binary);
+        std::vector<uint8_t> flatBytes((std::istreambuf_iterator<char>(flat)), std::istreambuf_iterator<char>());
+        if (flatBytes.size() != 0x30 || flatBytes[0x10] != 0xFF || flatBytes[0x1F] != 0xFF
+            || !std::equal(payload.begin(), payload.begin() + 16, flatBytes.begin() + 0x20)) {
+            std::cout << "Flat image FAILED!" << std::endl;
+            return -1;
+        }
+
+        if (!lazyFile.Images()[0].Extract("OutputTest.bin", 0)) {
+            std::cout << "Extract FAILED!" << std::endl;
+            return -1;
+        }
+        std::ifstream extracted("OutputTest.bin", std::ios_base::binary);
+        std::vector<uint8_t> extractedBytes((std::istreambuf_iterator<char>(extracted)), std::istreambuf_iterator<char>());
+        if (extractedBytes.size() != payload.size() || !std::equal(payload.begin(), payload.end(), extractedBytes.begin())) {
+            std::cout << "Extracted data MISMATCH!" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint8_t> hexText;
+        dfuse::sink::Memory hexSink(hexText);
+        std::vector<dfuse::DFUTarget> memoryHexElements;
+        if (!dfuse::writer::Hex.Write(hexSink, myFile.Images()[0].Elements()[0])
+            || !dfuse::reader::ReadHex(dfuse::ByteSpan(hexText), memoryHexElements)
+            || memoryHexElements.size() != 1 || memoryHexElements[0].Data().size() != payload.size()) {
+            std::cout << "Memory sink FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint8_t> truncatedHex(hexText.begin(), hexText.end() - dfuse::detail::IntelHex::EofLength);
+        std::vector<dfuse::DFUTarget> truncatedElements;
+        if (dfuse::reader::ReadHex(dfuse::ByteSpan(truncatedHex), truncatedElements)) {
+            std::cout << "Truncated HEX check FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint8_t> large(9 * 1024 * 1024 + 123);
+        for (size_t i = 0; i < large.size(); i++) {
+            large[i] = (uint8_t)(i * 2654435761u >> 13);
+        }
+        uint32_t whole = dfuse::crc::Compute(large.data(), large.size());
+        size_t split = large.size() / 3;
+        uint32_t combined = dfuse::crc::Combine(dfuse::crc::Compute(large.data(), split),
+                                                dfuse::crc::Compute(large.data() + split, large.size() - split),
+                                                large.size() - split);
+        if (combined != whole || dfuse::crc::UpdateParallel(0xFFFFFFFF, large.data(), large.size()) != whole
+            || dfuse::crc::UpdateParallel(0xFFFFFFFF, large.data(), large.size(), 2) != whole) {
+            std::cout << "Parallel CRC FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint8_t> arenaBuffer(256 * 1024);
+        std::pmr::monotonic_buffer_resource arena(arenaBuffer.data(), arenaBuffer.size());
+        dfuse::DFUFile arenaFile("TestDFU.dfu", dfuse::LoadMode::Arena, &arena);
+        dfuse::ByteSpan arenaPayload = arenaFile.Images()[0].Elements()[0].Data();
+        if (!arenaFile || arenaFile.CrcStatus() != dfuse::CrcCheck::Passed || arenaPayload.size() != payload.size()
+            || (uintptr_t)arenaPayload.data() % 64 != 0 || arenaPayload.data() < arenaBuffer.data()
+            || arenaPayload.end() > arenaBuffer.data() + arenaBuffer.size()
+            || !std::equal(payload.begin(), payload.end(), arenaPayload.begin())) {
+            std::cout << "Arena load FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::DFUImage copy = myFile.Images()[0];
+        if (copy.Elements()[0].Data().data() != payload.data() || copy.Name() != myFile.Images()[0].Name()) {
+            std::cout << "Shared copy FAILED!" << std::endl;
+            return -1;
+        }
+        dfuse::DFUImage movedImage(std::move(copy));
+        if (!movedImage || copy || !copy.Elements().empty() || copy.Id() != 0 || std::string(copy.Name()) != "") {
+            std::cout << "Moved image FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint8_t> fanBin, fanHex, fanSRec, soloSRec;
+        dfuse::sink::Memory fanBinSink(fanBin), fanHexSink(fanHex), fanSRecSink(fanSRec), soloSRecSink(soloSRec);
+        std::array<uint8_t, 32> digest;
+        dfuse::writer::BinStage binStage(fanBinSink);
+        dfuse::writer::HexStage hexStage(fanHexSink);
+        dfuse::writer::SRecStage srecStage(fanSRecSink);
+        dfuse::writer::Sha256Stage shaStage(digest);
+        dfuse::writer::FanOut fan(binStage, hexStage, srecStage, shaStage);
+        dfuse::detail::Sha256 sha;
+        sha.Update(payload.data(), payload.size());
+        dfuse::writer::SRec.Write(soloSRecSink, myFile.Images()[0].Elements()[0]);
+        if (!fan.Write(myFile.Images()[0].Elements()[0], 1000) || fanHex != hexText || fanSRec != soloSRec || digest != sha.Final()
+            || !std::equal(payload.begin(), payload.end(), fanBin.begin()) || fanBin.size() != payload.size()) {
+            std::cout << "Fan-out writer FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint8_t> elf = WriteElf("OutputTest.elf");
+        std::vector<dfuse::DFUTarget> elfElements;
+        dfuse::DFUFile elfFile = dfuse::DFUBuilder(0x0483, 0xDF11).AddElf(0, "Elf", "OutputTest.elf").Build();
+        if (!dfuse::reader::ReadElf("OutputTest.elf", elfElements) || elfElements.size() != 2
+            || elfElements[0].Address() != 0x08000000 || elfElements[0].Size() != 0x30
+            || !std::equal(elf.begin() + 0x100, elf.begin() + 0x130, elfElements[0].Data().begin())
+            || (uintptr_t)elfElements[0].Data().data() % 4096 != 0x100
+            || elfElements[1].Address() != 0x08001000 || elfElements[1].Size() != 0x18
+            || !std::equal(elf.begin() + 0x200, elf.begin() + 0x210, elfElements[1].Data().begin())
+            || !std::equal(elf.begin() + 0x180, elf.begin() + 0x188, elfElements[1].Data().begin() + 0x10)
+            || !elfFile || elfFile.Images().size() != 1 || elfFile.Images()[0].Elements().size() != 2
+            || elfFile.Images()[0].Elements()[1].Address() != 0x08001000) {
+            std::cout << "ELF import FAILED!" << std::endl;
+            return -1;
+        }
+        if (dfuse::DFUBuilder(0x0483, 0xDF11).AddElf(0, "Elf", "Missing.elf").Build()
+            || dfuse::DFUBuilder(0x0483, 0xDF11).Add(0, "Bin", 0x08000000, "Missing.bin").Build()) {
+            std::cout << "Builder missing file FAILED!" << std::endl;
+            return -1;
+        }
+
+        CollectEvents events;
+        dfuse::StreamParser parser(events);
+        for (size_t i = 0; i < bytes.size(); i += 13) {
+            parser.Feed(bytes.data() + i, std::min<size_t>(13, bytes.size() - i));
+        }
+        if (!parser.Done() || events.elements.size() != 1
+            || events.elements[0].size() != myFile.Images()[0].Elements()[0].Data().size()
+            || !std::equal(events.elements[0].begin(), events.elements[0].end(),
+                           myFile.Images()[0].Elements()[0].Data().begin())) {
+            std::cout << "Stream parser FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::ProbeResult probe = dfuse::Probe("TestDFU.dfu");
+        auto probes = dfuse::ProbeFiles({ "TestDFU.dfu", "Missing.dfu", "RoundTrip.dfu" });
+        if (!probe || probe.Vendor != myFile.Vendor() || probe.Product != myFile.Product()
+            || probe.DeviceVersion != myFile.DeviceVersion() || probe.Targets != myFile.Images().size()
+            || probes.size() != 3 || !probes[0] || probes[1] || !probes[2] || probes[0].Product != probe.Product) {
+            std::cout << "Probe FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::remove("TestDFU.dfu.dfuidx");
+        dfuse::DFUFile indexing("TestDFU.dfu", dfuse::LoadMode::Indexed);
+        dfuse::DFUFile indexed("TestDFU.dfu", dfuse::LoadMode::Indexed);
+        dfuse::detail::Sha256 payloadSha;
+        payloadSha.Update(payload.data(), payload.size());
+        auto payloadDigest = payloadSha.Final();
+        std::ifstream sidecar("TestDFU.dfu.dfuidx", std::ios_base::binary);
+        if (!indexing || !indexed || !sidecar || indexed.CrcStatus() != dfuse::CrcCheck::Passed
+            || indexed.Crc() != myFile.Crc() || indexed.Vendor() != myFile.Vendor()
+            || indexed.Images().size() != 1 || indexed.Images()[0].Elements().size() != 1
+            || indexed.Images()[0].Elements()[0].Size() != (int)payload.size()
+            || !std::equal(payload.begin(), payload.end(), indexed.Images()[0].Elements()[0].Data().begin())
+            || indexed.ElementDigest(0, 0) != payloadDigest || indexing.ElementDigest(0, 0) != payloadDigest) {
+            std::cout << "Indexed load FAILED!" << std::endl;
+            return -1;
+        }
+        std::ofstream("TestDFU.dfu.dfuidx", std::ios_base::binary) << "stale";
+        if (!dfuse::DFUFile("TestDFU.dfu", dfuse::LoadMode::Indexed)) {
+            std::cout << "Stale index FAILED!" << std::endl;
+            return -1;
+        }
+
+        dfuse::FileCache cache(1);
+        std::vector<std::shared_ptr<const dfuse::DFUFile>> snapshots(4);
+        std::vector<std::thread> readers;
+        for (size_t i = 0; i < snapshots.size(); i++) {
+            readers.emplace_back([&, i] { snapshots[i] = cache.Get("TestDFU.dfu"); });
+        }
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        auto other = cache.Get("RoundTrip.dfu");
+        if (!snapshots[0] || snapshots[0]->Vendor() != myFile.Vendor() || snapshots[0]->Images()[0].Id() != 0
+            || std::count(snapshots.begin(), snapshots.end(), snapshots[0]) != 4 || !other || cache.Count() != 1
+            || cache.Get("RoundTrip.dfu") != other || cache.Get("Missing.dfu")) {
+            std::cout << "File cache FAILED!" << std::endl;
+            return -1;
+        }
+
+        size_t sequentialCalls = 0;
+        auto sequential = [&](size_t count, const std::function<void(size_t)>& fn) {
+            for (size_t i = 0; i < count; i++, sequentialCalls++) {
+                fn(i);
+            }
+        };
+        auto catalog = dfuse::ScanFiles({ "TestDFU.dfu", "Missing.dfu" }, sequential);
+        auto scanned = dfuse::ScanDirectory(".", false);
+        auto found = std::find_if(scanned.begin(), scanned.end(), [](const dfuse::CatalogEntry& entry) {
+            return entry.Path.find("TestDFU.dfu") != std::string::npos;
+        });
+        if (sequentialCalls != 2 || !catalog[0] || catalog[1] || catalog[0].Vendor != myFile.Vendor()
+            || catalog[0].CrcStatus != dfuse::CrcCheck::Passed || catalog[0].Targets.size() != 1
+            || catalog[0].Targets[0].Elements.size() != 1
+            || catalog[0].Targets[0].Elements[0].Size != payload.size()
+            || found == scanned.end() || !*found || found->Crc != myFile.Crc()) {
+            std::cout << "Scan FAILED!" << std::endl;
+            return -1;
+        }
+
+        // Image prefix claiming 0xFFFFFFFF elements in a 301 byte file
+        std::vector<char> evil(bytes.begin(), bytes.begin() + 11 + 274);
+        std::fill(evil.begin() + 11 + 270, evil.begin() + 11 + 274, (char)0xFF);
+        evil.insert(evil.end(), bytes.end() - 16, bytes.end());
+        std::ofstream("OutputTest.evil.dfu", std::ios_base::binary).write(evil.data(), evil.size());
+        auto evilCatalog = dfuse::ScanFiles({ "TestDFU.dfu", "OutputTest.evil.dfu" });
+        if (evil.size() != 301 || !evilCatalog[0] || evilCatalog[1]) {
+            std::cout << "Malformed scan FAILED!" << std::endl;
+            return -1;
+        }
+        for (dfuse::LoadMode mode : { dfuse::LoadMode::Stream, dfuse::LoadMode::Mapped, dfuse::LoadMode::Lazy,
+                                      dfuse::LoadMode::Arena, dfuse::LoadMode::Indexed }) {
+            if (dfuse::DFUFile("OutputTest.evil.dfu", mode)) {
+                std::cout << "Malformed load FAILED!" << std::endl;
+                return -1;
+            }
+        }
+        if (dfuse::DFUFile(evil.data(), evil.size()) || cache.Get("OutputTest.evil.dfu")) {
+            std::cout << "Malformed load FAILED!" << std::endl;
+            return -1;
+        }
+
+        std::vector<dfuse::CatalogEntry> releases(4, catalog[0]);
+        releases[1].DeviceVersion = 0x1500;
+        releases[1].Path = "V1.5.0.dfu";
+        releases[2].DeviceVersion = 0x1300;
+        releases[2].Path = "V1.3.0.dfu";
+        releases[3].Product = 0xFFFF;
+        releases[3].DeviceVersion = 0x1450;
+        releases[3].Path = "Any.dfu";
+        releases.push_back(catalog[1]);
+        dfuse::FirmwareIndex(dfuse::FirmwareIndex::Encode(releases)).Save("OutputTest.dfures");
+        dfuse::FirmwareIndex resolver("OutputTest.dfures");
+        auto resolve = [&](uint16_t product, uint16_t version) {
+            const dfuse::FirmwareIndex::Entry* entry = resolver.Resolve(0x0483, product, version);
+            return entry ? std::string(resolver.Path(*entry)) : std::string();
+        };
+        if (!resolver || resolver.Size() != 4 || resolve(0xDF11, 0xFFFF) != "V1.5.0.dfu"
+            || resolve(0xDF11, 0x1400) != "TestDFU.dfu" || resolve(0xDF11, 0x1460) != "Any.dfu"
+            || resolve(0xDF11, 0x1200) != "" || resolve(0x1234, 0x1460) != "Any.dfu") {
+            std::cout << "Firmware index FAILED!" << std::endl;
+            return -1;
+        }
+        std::vector<uint8_t> badIndex = dfuse::FirmwareIndex::Encode(releases);
+        badIndex.resize(badIndex.size() - 1);
+        if (dfuse::FirmwareIndex(badIndex) || dfuse::FirmwareIndex("Missing.dfures")
+            || dfuse::FirmwareIndex(badIndex).Save("OutputTest.dfures")) {
+            std::cout << "Firmware index validation FAILED!" << std::endl;
+            return -1;
+        }
+        std::unique_ptr<dfuse::FirmwareIndex> original(new dfuse::FirmwareIndex(dfuse::FirmwareIndex::Encode(releases)));
+        dfuse::FirmwareIndex copied(*original);
+        dfuse::FirmwareIndex assigned;
+        assigned = *original;
+        original.reset();
+        dfuse::FirmwareIndex moved(std::move(copied));
+        dfuse::FirmwareIndex mappedCopy = resolver;
+        const dfuse::FirmwareIndex::Entry* movedEntry = moved.Resolve(0x0483, 0xDF11, 0x1400);
+        const dfuse::FirmwareIndex::Entry* assignedEntry = assigned.Resolve(0x0483, 0xDF11, 0x1400);
+        if (copied || !movedEntry || std::string(moved.Path(*movedEntry)) != "TestDFU.dfu"
+            || !assignedEntry || std::string(assigned.Path(*assignedEntry)) != "TestDFU.dfu"
+            || !mappedCopy || mappedCopy.Size() != resolver.Size()) {
+            std::cout << "Firmware index copy FAILED!" << std::endl;
+            return -1;
+        }
         return 0;
     }
     return -1;